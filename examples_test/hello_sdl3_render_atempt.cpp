@@ -26,14 +26,16 @@ ImageTexture last_texture;
 
 glm::mat4 model_transform_matrix;
 
-class TexturedMaterial : public TSRPA::Material
+class TexturedMaterial final : public TSRPA::Material
 {
 public:
     TSRPA::Texture *texture;
 
+    unsigned int get_varyings() { return TSRPA::VARYING_ALL | TSRPA::VARYING_UV_DERIVATIVES; }
+
     glm::vec4 fragment_shader(TSRPA::ShaderFunctionData &data)
     {
-        glm::vec4 color = texture->sample(data.uv) * std::max(glm::dot(data.normal, glm::vec3(0, 0, -1)), 0.0f);
+        glm::vec4 color = texture->sample(data.uv, data.uv_ddx, data.uv_ddy) * std::max(glm::dot(data.normal, glm::vec3(0, 0, -1)), 0.0f);
         color.a = 1.0;
         return color;
     }
@@ -41,7 +43,7 @@ public:
 };
 TexturedMaterial textured_material;
 
-class TransparentMaterial : public TSRPA::Material
+class TransparentMaterial final : public TSRPA::Material
 {
 public:
     glm::vec4 color;
@@ -150,6 +152,7 @@ int main(int argc, char *argv[])
         0.1f,
         100.0f));
     occluder.set_projection_matrix(ren.get_projection_matrix());
+    occluder.set_lod_threshold(ren.get_lod_threshold(), ren.get_height());
     unsigned int lastTime = 0, currentTime;
     double delta_time;
     
@@ -201,13 +204,13 @@ int main(int argc, char *argv[])
                 ren.clear();
                 
 
-                ObjMesh new_mesh(event.drop.data);
+                ObjMesh new_mesh(event.drop.data, true, 4);
                 if (new_mesh.is_valid())
                 {
                     
                     last_mesh = new_mesh;
                     
-                    ren.draw_shaded_mesh(last_mesh, textured_material, model_transform_matrix);
+                    ren.draw_shaded_mesh_static(last_mesh, textured_material, model_transform_matrix);
                     
                 }
 
@@ -218,7 +221,7 @@ int main(int argc, char *argv[])
 
                     if (last_mesh.is_valid() && last_texture.is_valid())
                     {
-                        ren.draw_shaded_mesh(last_mesh, textured_material, model_transform_matrix);
+                        ren.draw_shaded_mesh_static(last_mesh, textured_material, model_transform_matrix);
                     }
                     else
                     {
@@ -249,7 +252,7 @@ int main(int argc, char *argv[])
 
 
             if(occluder.check_mesh(last_mesh, model_transform_matrix)){
-                ren.draw_shaded_mesh(last_mesh, textured_material, model_transform_matrix);
+                ren.draw_shaded_mesh_static(last_mesh, textured_material, model_transform_matrix);
             }
             
             
@@ -263,7 +266,7 @@ int main(int argc, char *argv[])
             //draw ghost
             
             if(occluder.check_mesh(last_mesh, ghost_matrix)){
-                ren.draw_shaded_mesh(last_mesh, transparent_material, ghost_matrix);
+                ren.draw_shaded_mesh_static(last_mesh, transparent_material, ghost_matrix);
             }
             
             ren.set_zbuffer_write(false);
@@ -273,7 +276,7 @@ int main(int argc, char *argv[])
             //draw smaller model to test occlusion
             
             if(occluder.check_mesh(last_mesh, occlude_matrix)){
-                ren.draw_shaded_mesh(last_mesh, textured_material, occlude_matrix);
+                ren.draw_shaded_mesh_static(last_mesh, textured_material, occlude_matrix);
             }
             
             
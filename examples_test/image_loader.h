@@ -41,5 +41,7 @@ public:
         SDL_DestroySurface(new_image_data);
 
         SDL_DestroySurface(image_data);
+
+        build_mipmaps();
     }
 };
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include <cstdio>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#define TSRPA_MULT_THREAD_RENDERER
+#include "tsrpa.h"
+
+// a material written against the per-matrix vertex_shader only, through LegacyMaterial it must keep being called on every draw path
+class PerMatrixMaterial : public TSRPA::LegacyMaterial
+{
+public:
+    void vertex_shader(TSRPA::ShaderFunctionData &data, const glm::mat4 &projection, const glm::mat4 &view, const glm::mat4 &model, const glm::mat3 &normal_matrix)
+    {
+        data.position = (projection * view * model) * data.position;
+        data.position.x += 0.5f * data.position.w;
+    }
+    glm::vec4 fragment_shader(TSRPA::ShaderFunctionData &data)
+    {
+        return glm::vec4(1.0f, 0.5f, 0.25f, 1.0f);
+    }
+};
+
+// the same shader written against the uniforms signature, the reference the legacy one is compared with
+class UniformsMaterial : public TSRPA::Material
+{
+public:
+    void vertex_shader(TSRPA::ShaderFunctionData &data, const TSRPA::ShaderUniforms &uniforms)
+    {
+        data.position = uniforms.mvp * data.position;
+        data.position.x += 0.5f * data.position.w;
+    }
+    glm::vec4 fragment_shader(TSRPA::ShaderFunctionData &data)
+    {
+        return glm::vec4(1.0f, 0.5f, 0.25f, 1.0f);
+    }
+};
+
+const unsigned int size = 64;
+
+void make_quad(TSRPA::Mesh &mesh)
+{
+    mesh.vertex = {glm::vec3(-1, -1, 0), glm::vec3(1, -1, 0), glm::vec3(1, 1, 0), glm::vec3(-1, 1, 0)};
+    mesh.uv = {glm::vec2(0, 0), glm::vec2(1, 0), glm::vec2(1, 1), glm::vec2(0, 1)};
+    mesh.normal.assign(4, glm::vec3(0, 0, -1));
+    mesh.color.assign(4, glm::vec3(1));
+    mesh.index = {0, 1, 2, 0, 2, 3};
+    mesh.vert_count = mesh.vertex.size();
+    mesh.face_count = mesh.index.size() / 3;
+}
+
+template <typename RendererT>
+void setup(RendererT &ren)
+{
+    ren.set_face_mode(TSRPA::BOTH);
+    ren.set_view_matrix(glm::lookAt(glm::vec3(0.0f), glm::vec3(0, 0, 5.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+    ren.set_projection_matrix(glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 100.0f));
+    ren.clear();
+}
+
+std::vector<unsigned char> result(TSRPA::Renderer &ren)
+{
+    unsigned char *px = ren.get_result();
+    return std::vector<unsigned char>(px, px + size * size * 4);
+}
+
+// frame of a virtual draw through Renderer&, the only path the material could take before draw_shaded_mesh_static existed
+template <typename RendererT, typename MaterialT>
+std::vector<unsigned char> draw_virtual(TSRPA::Mesh &mesh, MaterialT &material, glm::mat4 &transform)
+{
+    RendererT ren(size, size);
+    setup(ren);
+    TSRPA::Renderer &base = ren;
+    base.draw_shaded_mesh(mesh, material, transform);
+    return result(ren);
+}
+
+template <typename RendererT, typename MaterialT>
+std::vector<unsigned char> draw_concrete(TSRPA::Mesh &mesh, MaterialT &material, glm::mat4 &transform)
+{
+    RendererT ren(size, size);
+    setup(ren);
+    ren.draw_shaded_mesh(mesh, material, transform);
+    return result(ren);
+}
+
+template <typename RendererT, typename MaterialT>
+std::vector<unsigned char> draw_static(TSRPA::Mesh &mesh, MaterialT &material, glm::mat4 &transform)
+{
+    RendererT ren(size, size);
+    setup(ren);
+    ren.draw_shaded_mesh_static(mesh, material, transform);
+    return result(ren);
+}
+
+int failures = 0;
+
+void check(const char *name, const std::vector<unsigned char> &frame, const std::vector<unsigned char> &reference)
+{
+    bool same = frame == reference;
+    printf("%s: %s\n", name, same ? "ok" : "FAILED");
+    failures += same ? 0 : 1;
+}
+
+template <typename RendererT>
+void run(const char *renderer_name)
+{
+    TSRPA::Mesh quad;
+    make_quad(quad);
+    glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(0, 0, 5.0f));
+    PerMatrixMaterial legacy;
+    UniformsMaterial uniforms;
+    std::vector<unsigned char> reference = draw_virtual<RendererT>(quad, uniforms, transform);
+
+    // the reference must have drawn something and the legacy override must move it away from where the default shader puts it
+    TSRPA::Material plain;
+    std::vector<unsigned char> empty(size * size * 4, 0);
+    printf("%s\n", renderer_name);
+    failures += reference == empty || reference == draw_virtual<RendererT>(quad, plain, transform) ? 1 : 0;
+
+    check("  legacy, Renderer&", draw_virtual<RendererT>(quad, legacy, transform), reference);
+    check("  legacy, draw_shaded_mesh", draw_concrete<RendererT>(quad, legacy, transform), reference);
+    check("  legacy, draw_shaded_mesh_static", draw_static<RendererT>(quad, legacy, transform), reference);
+    check("  uniforms, draw_shaded_mesh_static", draw_static<RendererT>(quad, uniforms, transform), reference);
+}
+
+int main()
+{
+    run<TSRPA::SingleThreadRenderer>("SingleThreadRenderer");
+    run<TSRPA::MultThreadRenderer>("MultThreadRenderer");
+    if (failures == 0)
+    {
+        printf("all passed\n");
+        return 0;
+    }
+    printf("%d failed\n", failures);
+    return 1;
+}
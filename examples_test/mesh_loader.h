@@ -5,11 +5,17 @@
 
 #include "tsrpa.h"
 
+#include <map>
+#include <tuple>
+
 class ObjMesh : public TSRPA::Mesh
 {
 public:
     ObjMesh() : TSRPA::Mesh() {}
-    ObjMesh(const char *path) : TSRPA::Mesh()
+    // indexed keeps one copy of every distinct position/normal/uv combination and fills the index buffer
+    // indexed meshes are also reordered by optimize_mesh and get up to lod_levels simplified levels of detail, off unless asked for as they replace the mesh on small draws
+    // they and their levels of detail are split into clusters of up to cluster_faces faces for culling, 0 skips that
+    ObjMesh(const char *path, bool indexed = true, unsigned int lod_levels = 0, unsigned int cluster_faces = 64) : TSRPA::Mesh()
     {
         SDL_Log("loading: %s\n", path);
 
@@ -37,6 +43,8 @@ public:
             SDL_Log("%s\n", materials[0].alpha_texname.c_str());
         }
 
+        std::map<std::tuple<int, int, int>, unsigned int> unique_vertices;
+
         for (size_t s = 0; s < shapes.size(); s++)
         {
             
@@ -50,6 +58,18 @@ public:
                 {
                     
                     tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+                    if (indexed)
+                    {
+                        std::tuple<int, int, int> key(idx.vertex_index, idx.normal_index, idx.texcoord_index);
+                        std::map<std::tuple<int, int, int>, unsigned int>::iterator found = unique_vertices.find(key);
+                        if (found != unique_vertices.end())
+                        {
+                            this->index.push_back(found->second);
+                            continue;
+                        }
+                        unique_vertices[key] = this->vertex.size();
+                        this->index.push_back(this->vertex.size());
+                    }
                     this->vertex.push_back(glm::vec3(
                         attrib.vertices[3 * size_t(idx.vertex_index) + 0],
                         attrib.vertices[3 * size_t(idx.vertex_index) + 1],
@@ -85,6 +105,23 @@ public:
             }
         }
         this->vert_count = this->vertex.size();
-        this->face_count = this->vertex.size() / 3;
+        this->face_count = indexed ? this->index.size() / 3 : this->vertex.size() / 3;
+
+        if (indexed)
+        {
+            TSRPA::optimize_mesh(*this);
+        }
+        if (indexed && lod_levels > 0)
+        {
+            TSRPA::build_lods(*this, lod_levels);
+        }
+        if (indexed && cluster_faces > 0)
+        {
+            TSRPA::build_clusters(*this, cluster_faces);
+            for (size_t i = 0; i < this->lods.size(); i++)
+            {
+                TSRPA::build_clusters(*this->lods[i], cluster_faces);
+            }
+        }
     }
 };
\ No newline at end of file
@@ -2,8 +2,16 @@
 #include <iostream>
 #include <cmath>
 #include <functional>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include <vector>
+#include <map>
+#include <memory>
+
+#if !defined(TSRPA_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TSRPA_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef TSRPA_MULT_THREAD_RENDERER
 #include <thread>
@@ -80,6 +88,59 @@ namespace TSRPA
             return (glm::vec4)(get_color(uv.x * width, height - (uv.y * height))) / glm::vec4(255.0, 255.0, 255.0, 255.0);
         }
 
+        // samples the level whose texels best match the screen space footprint ddx, ddy of uv, the base level while build_mipmaps was not called
+        glm::vec4 sample(glm::vec2 uv, glm::vec2 ddx, glm::vec2 ddy)
+        {
+            glm::vec2 size((float)width, (float)height);
+            glm::vec2 texels_x = ddx * size;
+            glm::vec2 texels_y = ddy * size;
+            float footprint = std::max(glm::dot(texels_x, texels_x), glm::dot(texels_y, texels_y));
+            // footprint is squared, half its log2 is the level
+            int level = footprint > 1.0f ? (int)(0.5f * std::log2(footprint) + 0.5f) : 0;
+            if (level == 0 || mips.empty())
+            {
+                return sample(uv);
+            }
+            return mips[std::min(level, (int)mips.size()) - 1]->sample(uv);
+        }
+
+        // box filtered levels of half the size of the one above, down to 1x1, mips[0] is the level under the base one
+        // set_color does not update them, call build_mipmaps again after changing the texture
+        std::vector<std::shared_ptr<Texture>> mips;
+
+        void build_mipmaps()
+        {
+            mips.clear();
+            if (!is_valid())
+            {
+                return;
+            }
+            const Texture *level = this;
+            while (level->width > 1 || level->height > 1)
+            {
+                std::shared_ptr<Texture> next = std::make_shared<Texture>(std::max(level->width / 2, 1u), std::max(level->height / 2, 1u));
+                for (unsigned int y = 0; y < next->height; y++)
+                {
+                    unsigned int y0 = std::min(y * 2, level->height - 1);
+                    unsigned int y1 = std::min(y * 2 + 1, level->height - 1);
+                    for (unsigned int x = 0; x < next->width; x++)
+                    {
+                        unsigned int x0 = std::min(x * 2, level->width - 1);
+                        unsigned int x1 = std::min(x * 2 + 1, level->width - 1);
+                        unsigned int texels[4] = {(y0 * level->width + x0) * 4, (y0 * level->width + x1) * 4, (y1 * level->width + x0) * 4, (y1 * level->width + x1) * 4};
+                        unsigned int i = (y * next->width + x) * 4;
+                        for (int c = 0; c < 4; c++)
+                        {
+                            unsigned int sum = level->data[texels[0] + c] + level->data[texels[1] + c] + level->data[texels[2] + c] + level->data[texels[3] + c];
+                            next->data[i + c] = (sum + 2) / 4;
+                        }
+                    }
+                }
+                mips.push_back(next);
+                level = next.get();
+            }
+        }
+
         void set_color(const unsigned int &x, const unsigned int &y, const glm::ivec4 &color)
         {
             unsigned int i = (y * width + x) * 4;
@@ -90,6 +151,8 @@ namespace TSRPA
         }
     };
 
+    // bone_index, bone_weight and finalBonesMatrices are gone, nothing filled them and they made every copy of a vertex about 300 bytes larger
+    // skinned vertices come from SkinnedMesh, posed once per frame by Renderer::skin_mesh, and reach vertex_shader with position and normal already skinned
     struct ShaderFunctionData
     {
         glm::vec4 position = glm::vec4(0.0, 0.0, 0.0, 1.0);
@@ -97,19 +160,87 @@ namespace TSRPA
         glm::vec2 uv2 = glm::vec2(0.0, 0.0);
         glm::vec3 normal = glm::vec3(0.0, 0.0, 0.0);
         glm::vec3 color = glm::vec3(0.0, 0.0, 0.0);
+        // screen space derivatives of uv, only filled for materials that ask for VARYING_UV_DERIVATIVES
+        glm::vec2 uv_ddx = glm::vec2(0.0, 0.0);
+        glm::vec2 uv_ddy = glm::vec2(0.0, 0.0);
+    };
+
+    // varyings a material reads in its fragment shader, the rasterizer only interpolates these
+    enum Varying
+    {
+        VARYING_POSITION = 1,
+        VARYING_UV = 2,
+        VARYING_UV2 = 4,
+        VARYING_NORMAL = 8,
+        VARYING_COLOR = 16,
+        VARYING_ALL = 31,
+        // uv_ddx and uv_ddy, implies VARYING_UV, left out of VARYING_ALL as it costs two more uv interpolations per fragment
+        VARYING_UV_DERIVATIVES = 32,
+    };
+
+    const int FRAGMENT_PACKET_SIZE = 8;
+
+    // up to FRAGMENT_PACKET_SIZE fragments shaded by one fragment_shader_packet call, every component is an array with one lane per fragment
+    // lanes are filled in raster order from lane 0, bit i of mask is set when lane i holds a fragment
+    struct FragmentPacket
+    {
+        unsigned int mask = 0;
+        unsigned int x[FRAGMENT_PACKET_SIZE];
+        unsigned int y[FRAGMENT_PACKET_SIZE];
+        float position[4][FRAGMENT_PACKET_SIZE];
+        float uv[2][FRAGMENT_PACKET_SIZE];
+        float uv2[2][FRAGMENT_PACKET_SIZE];
+        float normal[3][FRAGMENT_PACKET_SIZE];
+        float color[3][FRAGMENT_PACKET_SIZE];
+        float uv_ddx[2][FRAGMENT_PACKET_SIZE];
+        float uv_ddy[2][FRAGMENT_PACKET_SIZE];
+        // rgba result of every lane in mask, written by the shader
+        float fragment_color[4][FRAGMENT_PACKET_SIZE];
+    };
+
+    // matrices of one draw, computed once by the renderer instead of once per vertex
+    struct ShaderUniforms
+    {
+        glm::mat4 model;
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::mat4 view_projection;
+        glm::mat4 mvp;
+        glm::mat3 normal_matrix;
+
+        // set by draw_shaded_mesh_instanced: which instance is drawn and its element of the per-instance data, NULL when the draw has none
+        unsigned int instance_id = 0;
+        const void *instance_data = NULL;
+
+        ShaderUniforms() {}
+        ShaderUniforms(const glm::mat4 &model, const glm::mat4 &view, const glm::mat4 &projection)
+        {
+            this->view = view;
+            this->projection = projection;
+            view_projection = projection * view;
+            set_model(model);
+        }
 
-        int bone_index[4] = {0, 0, 0, 0};
-        float bone_weight[4] = {0.0, 0.0, 0.0, 0.0};
-        glm::mat4 finalBonesMatrices[4];
+        // next model matrix under the same view and projection, view_projection is not recomputed
+        void set_model(const glm::mat4 &model)
+        {
+            this->model = model;
+            mvp = view_projection * model;
+            // inverse transpose of the upper 3x3 built from its cofactors, cheaper than a general inverse
+            glm::vec3 c0(model[0]), c1(model[1]), c2(model[2]);
+            glm::vec3 cofactor0 = glm::cross(c1, c2);
+            normal_matrix = glm::mat3(cofactor0, glm::cross(c2, c0), glm::cross(c0, c1)) * (1.0f / glm::dot(c0, cofactor0));
+        }
     };
 
     class Material
     {
     public:
-        virtual void vertex_shader(ShaderFunctionData &data, const glm::mat4 &projection, const glm::mat4 &view, const glm::mat4 &model, const glm::mat3 &normal_matrix)
+        // what the renderer calls, once per vertex with the uniforms of the draw
+        virtual void vertex_shader(ShaderFunctionData &data, const ShaderUniforms &uniforms)
         {
-            data.normal = glm::normalize(normal_matrix * data.normal);
-            data.position = (projection * view * model) * data.position;
+            data.normal = glm::normalize(uniforms.normal_matrix * data.normal);
+            data.position = uniforms.mvp * data.position;
         }
 
         virtual glm::vec4 fragment_shader(ShaderFunctionData &data)
@@ -117,22 +248,201 @@ namespace TSRPA
             return glm::vec4(1.0, 1.0, 1.0, 1.0);
         }
 
+        // materials that return true are shaded a packet at a time through fragment_shader_packet, the others per fragment through fragment_shader
+        virtual bool has_fragment_shader_packet() { return false; }
+
+        // fills packet.fragment_color for the lanes in packet.mask, the varyings are interpolated and normalized as fragment_shader gets them
+        virtual void fragment_shader_packet(FragmentPacket &packet) {}
+
+        // mask of Varying values fragment_shader reads, the fields it leaves out are unspecified in the fragment data
+        virtual unsigned int get_varyings() { return VARYING_ALL; }
+
         Material() {}
     };
 
+    // base of materials written against the per-matrix vertex_shader, Material no longer calls that signature
+    // every vertex pays for projection * view * model again, materials that can should override the uniforms one of Material instead
+    class LegacyMaterial : public Material
+    {
+    public:
+        virtual void vertex_shader(ShaderFunctionData &data, const glm::mat4 &projection, const glm::mat4 &view, const glm::mat4 &model, const glm::mat3 &normal_matrix)
+        {
+            data.normal = glm::normalize(normal_matrix * data.normal);
+            data.position = (projection * view * model) * data.position;
+        }
+
+        void vertex_shader(ShaderFunctionData &data, const ShaderUniforms &uniforms)
+        {
+            vertex_shader(data, uniforms.projection, uniforms.view, uniforms.model, uniforms.normal_matrix);
+        }
+    };
+
+    enum VertexAttribute
+    {
+        ATTRIBUTE_POSITION = 0,
+        ATTRIBUTE_UV = 1,
+        ATTRIBUTE_UV2 = 2,
+        ATTRIBUTE_NORMAL = 3,
+        ATTRIBUTE_COLOR = 4,
+        ATTRIBUTE_COUNT = 5,
+    };
+
+    // float components per element of an attribute
+    enum VertexFormat
+    {
+        FORMAT_NONE = 0,
+        FORMAT_FLOAT = 1,
+        FORMAT_FLOAT2 = 2,
+        FORMAT_FLOAT3 = 3,
+        FORMAT_FLOAT4 = 4,
+    };
+
+    // where one attribute lives in memory, the element of vertex i starts at data + offset + i * stride bytes
+    // separate arrays (stride = element size) and interleaved vertices (shared data, per attribute offset) are both described by it
+    struct VertexAttributeLayout
+    {
+        const void *data = NULL;
+        VertexFormat format = FORMAT_NONE;
+        unsigned int offset = 0;
+        unsigned int stride = 0;
+    };
+
+    struct VertexLayout
+    {
+        VertexAttributeLayout attributes[ATTRIBUTE_COUNT];
+    };
+
+    template <typename T>
+    inline VertexAttributeLayout array_attribute(const std::vector<T> &values, VertexFormat format)
+    {
+        VertexAttributeLayout attribute;
+        if (values.size() > 0)
+        {
+            attribute.data = &values[0];
+            attribute.format = format;
+            attribute.stride = sizeof(T);
+        }
+        return attribute;
+    }
+
+    // one element of an attribute, components the format does not have keep their value from defaults
+    inline glm::vec4 read_attribute(const VertexAttributeLayout &attribute, const unsigned int id, glm::vec4 defaults)
+    {
+        if (attribute.data != NULL)
+        {
+            const float *in = (const float *)((const unsigned char *)attribute.data + attribute.offset + id * attribute.stride);
+            for (int c = 0; c < attribute.format; c++)
+            {
+                defaults[c] = in[c];
+            }
+        }
+        return defaults;
+    }
+
+    // object space bounding volumes of a mesh
+    struct MeshBounds
+    {
+        glm::vec3 min;
+        glm::vec3 max;
+        glm::vec3 center;
+        float radius;
+    };
+
+    // run of faces first_face .. first_face + face_count - 1 that are culled together
+    // cone_axis and cone_cutoff bound the face normals: every normal is within asin(cone_cutoff) of 90 degrees off the axis, 1 when they spread too far to bound
+    struct MeshCluster
+    {
+        unsigned int first_face;
+        unsigned int face_count;
+        glm::vec3 center;
+        float radius;
+        glm::vec3 cone_axis;
+        float cone_cutoff;
+    };
+
     class MeshBase
     {
+    protected:
+        MeshBounds bounds;
+        bool bounds_valid = false;
+
     public:
         unsigned int vert_count;
         unsigned int face_count;
+        // filled by build_clusters, when empty the mesh is culled as a whole only
+        std::vector<MeshCluster> clusters;
 
         MeshBase() {}
 
+        // the clusters culling may use, meshes whose drawn geometry moves away from the one clusters were built on return none
+        virtual const std::vector<MeshCluster> &get_clusters() { return clusters; }
+
         virtual bool is_valid() { return vert_count > 0; }
 
         virtual void get_vertex_data(ShaderFunctionData &data, const unsigned int &id)
         {
         }
+
+        // meshes that can describe their vertex memory fill layout and return true, the renderer then reads it directly instead of calling get_vertex_data per vertex
+        virtual bool get_vertex_layout(VertexLayout &layout) { return false; }
+
+        // id of the vertex at corner (0..2) of a face
+        virtual unsigned int get_face_vertex(const unsigned int &face_id, const unsigned int &corner)
+        {
+            return face_id * 3 + corner;
+        }
+
+        // object space position only, for passes that need no other attribute
+        virtual glm::vec4 get_vertex_position(const unsigned int &id)
+        {
+            ShaderFunctionData data;
+            get_vertex_data(data, id);
+            return data.position;
+        }
+
+        // computed on first use and cached, call invalidate_bounds after moving vertices
+        const MeshBounds &get_bounds()
+        {
+            if (!bounds_valid)
+            {
+                update_bounds();
+            }
+            return bounds;
+        }
+
+        void invalidate_bounds() { bounds_valid = false; }
+
+        // every face as one cluster around the mesh bounds, with a cone that never culls
+        MeshCluster whole_cluster()
+        {
+            const MeshBounds &mesh_bounds = get_bounds();
+            MeshCluster whole = {0, face_count, mesh_bounds.center, mesh_bounds.radius, glm::vec3(0.0f, 0.0f, 1.0f), 1.0f};
+            return whole;
+        }
+
+        // mesh to draw when max_error object space units of deviation are invisible, meshes without levels of detail return themselves
+        virtual MeshBase &select_lod(float max_error) { return *this; }
+
+        void update_bounds()
+        {
+            bounds.min = glm::vec3(0.0f);
+            bounds.max = glm::vec3(0.0f);
+            for (unsigned int i = 0; i < vert_count; i++)
+            {
+                glm::vec3 p = get_vertex_position(i);
+                bounds.min = i == 0 ? p : glm::min(bounds.min, p);
+                bounds.max = i == 0 ? p : glm::max(bounds.max, p);
+            }
+            bounds.center = (bounds.min + bounds.max) * 0.5f;
+            float radius2 = 0.0f;
+            for (unsigned int i = 0; i < vert_count; i++)
+            {
+                glm::vec3 d = glm::vec3(get_vertex_position(i)) - bounds.center;
+                radius2 = std::max(radius2, glm::dot(d, d));
+            }
+            bounds.radius = std::sqrt(radius2);
+            bounds_valid = true;
+        }
     };
 
     class Mesh : public MeshBase
@@ -144,9 +454,48 @@ namespace TSRPA
         std::vector<glm::vec3> normal;
         std::vector<glm::vec3> color;
         std::vector<int> material_idx;
+        // three vertex ids per face, when empty the streams above hold three vertices per face
+        std::vector<unsigned int> index;
+        // coarser versions filled by build_lods, lods[i] deviates from this mesh by at most about lod_error[i] in object space
+        std::vector<std::shared_ptr<Mesh>> lods;
+        std::vector<float> lod_error;
 
         Mesh() : MeshBase() {}
 
+        MeshBase &select_lod(float max_error)
+        {
+            MeshBase *selected = this;
+            for (unsigned int i = 0; i < lods.size() && lod_error[i] <= max_error; i++)
+            {
+                selected = lods[i].get();
+            }
+            return *selected;
+        }
+
+        bool get_vertex_layout(VertexLayout &layout)
+        {
+            layout.attributes[ATTRIBUTE_POSITION] = array_attribute(vertex, FORMAT_FLOAT3);
+            layout.attributes[ATTRIBUTE_UV] = array_attribute(uv, FORMAT_FLOAT2);
+            layout.attributes[ATTRIBUTE_UV2] = array_attribute(uv2, FORMAT_FLOAT2);
+            layout.attributes[ATTRIBUTE_NORMAL] = array_attribute(normal, FORMAT_FLOAT3);
+            layout.attributes[ATTRIBUTE_COLOR] = array_attribute(color, FORMAT_FLOAT3);
+            return true;
+        }
+
+        unsigned int get_face_vertex(const unsigned int &face_id, const unsigned int &corner)
+        {
+            if (index.size() > 0)
+            {
+                return index[face_id * 3 + corner];
+            }
+            return face_id * 3 + corner;
+        }
+
+        glm::vec4 get_vertex_position(const unsigned int &id)
+        {
+            return glm::vec4(vertex[id], 1.0);
+        }
+
         void get_vertex_data(ShaderFunctionData &data, const unsigned int &id)
         {
             data.position = glm::vec4(vertex[id], 1.0);
@@ -169,155 +518,1859 @@ namespace TSRPA
         }
     };
 
-    enum DeephMode
+    // mesh with up to four bone influences per vertex
+    // skin() poses the whole mesh once with a bone palette, every draw after it reads the skinned positions and normals like plain streams
+    class SkinnedMesh : public Mesh
     {
-        NONE = 0,
-        LESS = 1,
-        GREATER = 2,
-    };
+    public:
+        std::vector<glm::ivec4> bone_index;
+        std::vector<glm::vec4> bone_weight;
 
-    class OcclusionDetector
-    {
-    protected:
-        unsigned int width;
-        unsigned int height;
-        std::vector<float> zbuffer;
-        glm::mat4 view_matrix;
-        glm::mat4 projection_matrix;
-        bool zbuffer_write = true;
-        std::function<bool(unsigned int, float)> deep_check_func;
-        DeephMode deeph_mode;
+        // output of the last skin(), same length as vertex
+        std::vector<glm::vec3> skinned_vertex;
+        std::vector<glm::vec3> skinned_normal;
 
-    public:
-        bool deep_check_none(unsigned int idx, float value) { return true; }
-        bool deep_check_less(unsigned int idx, float value)
+        SkinnedMesh() : Mesh() {}
+
+        bool is_skinned() { return skinned_vertex.size() == vertex.size() && vertex.size() > 0; }
+
+        // levels of detail are not skinned, a posed mesh always draws itself
+        MeshBase &select_lod(float max_error) { return *this; }
+
+        // clusters bound the rest pose, a posed mesh is culled by the bounds skin() refreshes only
+        const std::vector<MeshCluster> &get_clusters()
         {
+            static const std::vector<MeshCluster> none;
+            return is_skinned() ? none : clusters;
+        }
 
-            if (zbuffer[idx] < value)
+        // linear blend skinning of every vertex against bones, normals are blended with the same matrices so bones should not scale non-uniformly
+        void skin(const std::vector<glm::mat4> &bones)
+        {
+            unsigned int count = vertex.size();
+            if (bones.empty() || bone_index.size() < count || bone_weight.size() < count)
             {
-                if (zbuffer_write)
+                return;
+            }
+            bool has_normal = normal.size() >= count;
+            skinned_vertex.resize(count);
+            skinned_normal.resize(has_normal ? count : 0);
+            const int last_bone = bones.size() - 1;
+
+            glm::vec3 bounds_min(0.0f), bounds_max(0.0f);
+            for (unsigned int i = 0; i < count; i++)
+            {
+                const glm::ivec4 &index = bone_index[i];
+                const glm::vec4 &weight = bone_weight[i];
+#ifdef TSRPA_SSE2
+                __m128 column[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+                for (int j = 0; j < 4; j++)
                 {
-                    zbuffer[idx] = value;
+                    const float *m = &bones[std::min(std::max(index[j], 0), last_bone)][0][0];
+                    __m128 w = _mm_set1_ps(weight[j]);
+                    for (int c = 0; c < 4; c++)
+                    {
+                        column[c] = _mm_add_ps(column[c], _mm_mul_ps(w, _mm_loadu_ps(m + c * 4)));
+                    }
                 }
-
-                return true;
+                const glm::vec3 &p = vertex[i];
+                __m128 xyz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(column[0], _mm_set1_ps(p.x)), _mm_mul_ps(column[1], _mm_set1_ps(p.y))), _mm_mul_ps(column[2], _mm_set1_ps(p.z)));
+                float out[4];
+                _mm_storeu_ps(out, _mm_add_ps(xyz, column[3]));
+                glm::vec3 position(out[0], out[1], out[2]);
+                if (has_normal)
+                {
+                    const glm::vec3 &n = normal[i];
+                    _mm_storeu_ps(out, _mm_add_ps(_mm_add_ps(_mm_mul_ps(column[0], _mm_set1_ps(n.x)), _mm_mul_ps(column[1], _mm_set1_ps(n.y))), _mm_mul_ps(column[2], _mm_set1_ps(n.z))));
+                    skinned_normal[i] = glm::vec3(out[0], out[1], out[2]);
+                }
+#else
+                glm::mat4 m = bones[std::min(std::max(index[0], 0), last_bone)] * weight[0];
+                for (int j = 1; j < 4; j++)
+                {
+                    m += bones[std::min(std::max(index[j], 0), last_bone)] * weight[j];
+                }
+                glm::vec3 position = glm::vec3(m * glm::vec4(vertex[i], 1.0f));
+                if (has_normal)
+                {
+                    skinned_normal[i] = glm::vec3(m * glm::vec4(normal[i], 0.0f));
+                }
+#endif
+                skinned_vertex[i] = position;
+                bounds_min = i == 0 ? position : glm::min(bounds_min, position);
+                bounds_max = i == 0 ? position : glm::max(bounds_max, position);
             }
-            return false;
+
+            // a box around the posed mesh comes for free here, the sphere around the box is looser than update_bounds but needs no second pass
+            bounds.min = bounds_min;
+            bounds.max = bounds_max;
+            bounds.center = (bounds_min + bounds_max) * 0.5f;
+            bounds.radius = glm::length(bounds_max - bounds.center);
+            bounds_valid = true;
         }
-        bool deep_check_greater(unsigned int idx, float value)
+
+        bool get_vertex_layout(VertexLayout &layout)
         {
-            if (zbuffer[idx] > value)
+            Mesh::get_vertex_layout(layout);
+            if (is_skinned())
             {
-                if (zbuffer_write)
+                layout.attributes[ATTRIBUTE_POSITION] = array_attribute(skinned_vertex, FORMAT_FLOAT3);
+                if (skinned_normal.size() > 0)
                 {
-                    zbuffer[idx] = value;
+                    layout.attributes[ATTRIBUTE_NORMAL] = array_attribute(skinned_normal, FORMAT_FLOAT3);
                 }
-                return true;
             }
-            return false;
+            return true;
         }
-        bool calculate_deep_check(unsigned int idx, float value)
+
+        glm::vec4 get_vertex_position(const unsigned int &id)
         {
-            return deep_check_func(idx, value);
+            return glm::vec4(is_skinned() ? skinned_vertex[id] : vertex[id], 1.0);
         }
 
-        glm::vec3 calculate_screen_position(const glm::vec3 &vertex, const glm::mat4 &model_transform_matrix)
+        void get_vertex_data(ShaderFunctionData &data, const unsigned int &id)
         {
+            Mesh::get_vertex_data(data, id);
+            if (is_skinned())
+            {
+                data.position = glm::vec4(skinned_vertex[id], 1.0);
+                if (skinned_normal.size() > 0)
+                {
+                    data.normal = skinned_normal[id];
+                }
+            }
+        }
+    };
 
-            glm::mat4 mvp = projection_matrix * view_matrix * model_transform_matrix;
-
-            glm::vec4 clip_space_pos = mvp * glm::vec4(vertex, 1.0);
 
-            glm::vec3 space_pos;
-            space_pos.x = clip_space_pos.x / clip_space_pos.w;
-            space_pos.y = clip_space_pos.y / clip_space_pos.w;
-            space_pos.z = clip_space_pos.z / clip_space_pos.w;
+    enum DeephMode
+    {
+        NONE = 0,
+        LESS = 1,
+        GREATER = 2,
+        LESS_EQUAL = 3,
+        GREATER_EQUAL = 4,
+        EQUAL = 5,
+    };
 
-            glm::vec3 screenSpacePos;
-            screenSpacePos.x = (space_pos.x + 1.0f) * 0.5f * width;
-            screenSpacePos.y = (1.0f - space_pos.y) * 0.5f * height;
-            screenSpacePos.z = 1.0f - space_pos.z;
+    // edge equations of a screen space triangle in 28.4 fixed point, set up once so the raster loop only has to add
+    // pixels exactly on an edge follow the top-left fill rule, so an edge shared by two triangles is only drawn once
+    struct TriangleEdges
+    {
+        static const int subpixel_bits = 4;
 
-            return screenSpacePos;
-        }
+        long long origin[3];
+        long long step_x[3];
+        long long step_y[3];
+        long long threshold[3];
+        float inv_area;
 
-        glm::vec3 calculate_screen_position_from_point(const glm::vec4 &pos)
+        bool setup(const glm::vec3 *pts)
         {
+            const float max_coordinate = 1 << 24;
+            long long x[3], y[3];
+            for (int i = 0; i < 3; i++)
+            {
+                if (!(std::abs(pts[i].x) < max_coordinate && std::abs(pts[i].y) < max_coordinate))
+                {
+                    return false;
+                }
+                x[i] = (long long)std::floor(pts[i].x * (1 << subpixel_bits) + 0.5f);
+                y[i] = (long long)std::floor(pts[i].y * (1 << subpixel_bits) + 0.5f);
+            }
 
-            glm::vec4 clip_space_pos = pos;
-
-            glm::vec3 space_pos;
-            space_pos.x = clip_space_pos.x / clip_space_pos.w;
-            space_pos.y = clip_space_pos.y / clip_space_pos.w;
-            space_pos.z = clip_space_pos.z / clip_space_pos.w;
-
-            glm::vec3 screenSpacePos;
-            screenSpacePos.x = (space_pos.x + 1.0f) * 0.5f * width;
-            screenSpacePos.y = (1.0f - space_pos.y) * 0.5f * height;
-            screenSpacePos.z = 1.0f - space_pos.z;
+            long long area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+            if (area == 0)
+            {
+                return false;
+            }
+            long long orientation = area > 0 ? 1 : -1;
+            inv_area = 1.0f / (float)(area * orientation);
 
-            return screenSpacePos;
+            // edge i is the one opposite to vertex i
+            for (int i = 0; i < 3; i++)
+            {
+                int a = (i + 1) % 3;
+                int b = (i + 2) % 3;
+                long long dx = (x[b] - x[a]) * orientation;
+                long long dy = (y[b] - y[a]) * orientation;
+                step_x[i] = -dy << subpixel_bits;
+                step_y[i] = dx << subpixel_bits;
+                origin[i] = dy * x[a] - dx * y[a];
+                threshold[i] = (dy < 0 || (dy == 0 && dx > 0)) ? -1 : 0;
+            }
+            return true;
         }
 
-        glm::vec3 barycentric(const glm::vec3 *pts, const glm::vec3 &P)
+        long long at(int i, int x, int y) const
         {
-            glm::vec3 u = glm::cross(glm::vec3(pts[2][0] - pts[0][0], pts[1][0] - pts[0][0], pts[0][0] - P[0]), glm::vec3(pts[2][1] - pts[0][1], pts[1][1] - pts[0][1], pts[0][1] - P[1]));
-            if (std::abs(u.z) < 1)
-            {
-                return glm::vec3(-1, 1, 1);
-            }
-            return glm::vec3(1.f - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z);
+            return origin[i] + step_x[i] * x + step_y[i] * y;
         }
 
-        void vertex_shader(ShaderFunctionData &data, const glm::mat4 &projection, const glm::mat4 &view, const glm::mat4 &model, const glm::mat3 &normal_matrix)
+        bool covers(const long long *e) const
         {
-            data.position = (projection * view * model) * data.position;
+            return e[0] > threshold[0] && e[1] > threshold[1] && e[2] > threshold[2];
         }
 
-        bool check_triangle(MeshBase &mesh, const unsigned int face_id, const glm::mat4 &transform, const glm::mat3 &normal_matrix)
+        glm::vec3 barycentric(const long long *e) const
         {
-            bool ret = false;
-            ShaderFunctionData vertex_data[3];
+            return glm::vec3(e[0] * inv_area, e[1] * inv_area, e[2] * inv_area);
+        }
 
+        // true when every edge value inside the rectangle fits the 32 bit lanes of the simd kernel
+        bool fits_int32(const glm::ivec2 &rect_min, const glm::ivec2 &rect_max) const
+        {
+            const long long limit = 0x7fffffffLL;
             for (int i = 0; i < 3; i++)
             {
-
-                mesh.get_vertex_data(vertex_data[i], (face_id * 3) + i);
+                long long lo = origin[i] + std::min(step_x[i] * rect_min.x, step_x[i] * rect_max.x) + std::min(step_y[i] * rect_min.y, step_y[i] * rect_max.y);
+                long long hi = origin[i] + std::max(step_x[i] * rect_min.x, step_x[i] * rect_max.x) + std::max(step_y[i] * rect_min.y, step_y[i] * rect_max.y);
+                if (lo < -limit || hi > limit)
+                {
+                    return false;
+                }
             }
+            return true;
+        }
 
-            glm::ivec2 bboxmin(width - 1, height - 1);
-            glm::ivec2 bboxmax(0, 0);
-            glm::ivec2 clamp(width - 1, height - 1);
-            glm::vec3 points[3];
-
+        // -1 when the pixel block is fully outside the triangle, 1 when it is fully inside and 0 when an edge crosses it
+        int classify_block(int x0, int y0, int x1, int y1) const
+        {
+            bool inside = true;
             for (int i = 0; i < 3; i++)
             {
-                vertex_shader(vertex_data[i], projection_matrix, view_matrix, transform, normal_matrix);
-                points[i] = calculate_screen_position_from_point(vertex_data[i].position);
+                long long lo = origin[i] + std::min(step_x[i] * x0, step_x[i] * x1) + std::min(step_y[i] * y0, step_y[i] * y1);
+                long long hi = origin[i] + std::max(step_x[i] * x0, step_x[i] * x1) + std::max(step_y[i] * y0, step_y[i] * y1);
+                if (hi <= threshold[i])
+                {
+                    return -1;
+                }
+                inside = inside && lo > threshold[i];
+            }
+            return inside ? 1 : 0;
+        }
+    };
 
+    // depth test of Mode, the switch folds away in every instantiation
+    template <DeephMode Mode>
+    inline bool depth_test(float depth, float z)
+    {
+        switch (Mode)
+        {
+        case DeephMode::NONE:
+            return true;
+        case DeephMode::LESS:
+            return depth < z;
+        case DeephMode::GREATER:
+            return depth > z;
+        case DeephMode::LESS_EQUAL:
+            return depth <= z;
+        case DeephMode::GREATER_EQUAL:
+            return depth >= z;
+        default:
+            return depth == z;
+        }
+    }
+
+#ifdef TSRPA_SSE2
+
+    // coverage, depth interpolation and depth test of 4 neighbouring pixels of a row at once
+    // e holds the edge values of the 4 pixels, returns one bit per pixel that passed and writes their barycentric weights to bc_out
+    // covered skips the coverage test for spans already known to be inside the triangle
+    // the depth mode and write are template parameters, so a raster loop specialised for them carries no state branch
+    template <DeephMode Mode, bool Write>
+    inline int raster_span_4(const __m128i *e, const TriangleEdges &edges, const glm::vec3 *points, float *zbuffer_span, float *bc_out, bool covered = false)
+    {
+        __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        if (!covered)
+        {
+            __m128i inside = _mm_cmpgt_epi32(e[0], _mm_set1_epi32((int)edges.threshold[0]));
+            inside = _mm_and_si128(inside, _mm_cmpgt_epi32(e[1], _mm_set1_epi32((int)edges.threshold[1])));
+            inside = _mm_and_si128(inside, _mm_cmpgt_epi32(e[2], _mm_set1_epi32((int)edges.threshold[2])));
+            mask = _mm_castsi128_ps(inside);
+            if (_mm_movemask_ps(mask) == 0)
+            {
+                return 0;
+            }
+        }
+
+        const __m128 inv_area = _mm_set1_ps(edges.inv_area);
+        __m128 b0 = _mm_mul_ps(_mm_cvtepi32_ps(e[0]), inv_area);
+        __m128 b1 = _mm_mul_ps(_mm_cvtepi32_ps(e[1]), inv_area);
+        __m128 b2 = _mm_mul_ps(_mm_cvtepi32_ps(e[2]), inv_area);
+
+        if (Mode != DeephMode::NONE)
+        {
+            __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b0, _mm_set1_ps(points[0].z)), _mm_mul_ps(b1, _mm_set1_ps(points[1].z))), _mm_mul_ps(b2, _mm_set1_ps(points[2].z)));
+            __m128 depth = _mm_loadu_ps(zbuffer_span);
+            __m128 pass;
+            switch (Mode)
+            {
+            case DeephMode::LESS:
+                pass = _mm_cmplt_ps(depth, z);
+                break;
+            case DeephMode::GREATER:
+                pass = _mm_cmpgt_ps(depth, z);
+                break;
+            case DeephMode::LESS_EQUAL:
+                pass = _mm_cmple_ps(depth, z);
+                break;
+            case DeephMode::GREATER_EQUAL:
+                pass = _mm_cmpge_ps(depth, z);
+                break;
+            default:
+                pass = _mm_cmpeq_ps(depth, z);
+                break;
+            }
+            mask = _mm_and_ps(mask, pass);
+            if (Write)
+            {
+                _mm_storeu_ps(zbuffer_span, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, depth)));
+            }
+        }
+
+        _mm_storeu_ps(bc_out, b0);
+        _mm_storeu_ps(bc_out + 4, b1);
+        _mm_storeu_ps(bc_out + 8, b2);
+        return _mm_movemask_ps(mask);
+    }
+
+    // raster_span_4 for a depth state only known at run time
+    inline int raster_span_4(const __m128i *e, const TriangleEdges &edges, const glm::vec3 *points, float *zbuffer_span, DeephMode mode, bool zbuffer_write, float *bc_out, bool covered = false)
+    {
+        switch (mode)
+        {
+        case DeephMode::NONE:
+            return raster_span_4<DeephMode::NONE, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        case DeephMode::LESS:
+            return zbuffer_write ? raster_span_4<DeephMode::LESS, true>(e, edges, points, zbuffer_span, bc_out, covered) : raster_span_4<DeephMode::LESS, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        case DeephMode::GREATER:
+            return zbuffer_write ? raster_span_4<DeephMode::GREATER, true>(e, edges, points, zbuffer_span, bc_out, covered) : raster_span_4<DeephMode::GREATER, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        case DeephMode::LESS_EQUAL:
+            return zbuffer_write ? raster_span_4<DeephMode::LESS_EQUAL, true>(e, edges, points, zbuffer_span, bc_out, covered) : raster_span_4<DeephMode::LESS_EQUAL, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        case DeephMode::GREATER_EQUAL:
+            return zbuffer_write ? raster_span_4<DeephMode::GREATER_EQUAL, true>(e, edges, points, zbuffer_span, bc_out, covered) : raster_span_4<DeephMode::GREATER_EQUAL, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        default:
+            return zbuffer_write ? raster_span_4<DeephMode::EQUAL, true>(e, edges, points, zbuffer_span, bc_out, covered) : raster_span_4<DeephMode::EQUAL, false>(e, edges, points, zbuffer_span, bc_out, covered);
+        }
+    }
+
+    // edge values of the 4 pixels starting at (x, y) and the increment that moves them 4 pixels to the right
+    inline void raster_span_4_setup(const TriangleEdges &edges, int x, int y, __m128i *e, __m128i *step)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            long long dx = edges.step_x[i];
+            e[i] = _mm_add_epi32(_mm_set1_epi32((int)edges.at(i, x, y)), _mm_set_epi32((int)(dx * 3), (int)(dx * 2), (int)dx, 0));
+            step[i] = _mm_set1_epi32((int)(dx * 4));
+        }
+    }
+
+#endif
+
+    enum ClipPlane
+    {
+        CLIP_NEAR = 1,
+        CLIP_LEFT = 2,
+        CLIP_RIGHT = 4,
+        CLIP_BOTTOM = 8,
+        CLIP_TOP = 16,
+    };
+
+    // largest screen extent in pixels whose 28.4 edge values still fit the 32 bit simd lanes
+    const float GUARD_BAND_PIXELS = 2000.0f;
+
+    // how far past the screen, in ndc units, triangles are left unclipped
+    inline float guard_band_scale(unsigned int width, unsigned int height)
+    {
+        return std::max(1.0f, GUARD_BAND_PIXELS / (float)std::max(width, height));
+    }
+
+    inline float clip_distance(const glm::vec4 &p, int plane, float guard_band)
+    {
+        switch (plane)
+        {
+        case CLIP_NEAR:
+            return p.z + p.w;
+        case CLIP_LEFT:
+            return p.x + p.w * guard_band;
+        case CLIP_RIGHT:
+            return p.w * guard_band - p.x;
+        case CLIP_BOTTOM:
+            return p.y + p.w * guard_band;
+        default:
+            return p.w * guard_band - p.y;
+        }
+    }
+
+    inline int clip_outcode(const glm::vec4 &p, float guard_band)
+    {
+        int code = 0;
+        for (int plane = CLIP_NEAR; plane <= CLIP_TOP; plane <<= 1)
+        {
+            if (clip_distance(p, plane, guard_band) < 0)
+            {
+                code |= plane;
+            }
+        }
+        return code;
+    }
+
+    inline const glm::vec4 &clip_position(const ShaderFunctionData &v) { return v.position; }
+    inline const glm::vec4 &clip_position(const glm::vec4 &v) { return v; }
+
+    inline glm::vec4 mix_vertex(const glm::vec4 &a, const glm::vec4 &b, float t)
+    {
+        return glm::mix(a, b, t);
+    }
+
+    inline ShaderFunctionData mix_vertex(const ShaderFunctionData &a, const ShaderFunctionData &b, float t)
+    {
+        ShaderFunctionData ret = a;
+        ret.position = glm::mix(a.position, b.position, t);
+        ret.uv = glm::mix(a.uv, b.uv, t);
+        ret.uv2 = glm::mix(a.uv2, b.uv2, t);
+        ret.normal = glm::mix(a.normal, b.normal, t);
+        ret.color = glm::mix(a.color, b.color, t);
+        return ret;
+    }
+
+    const unsigned int MAX_CLIPPED_VERTICES = 8;
+
+    // clips a triangle in homogeneous clip space against the near plane, and against a guard band around the screen only when it leaves it
+    // writes a convex polygon to polygon (room for MAX_CLIPPED_VERTICES) and returns its vertex count, 0 when nothing is left
+    // Vertex is either a full ShaderFunctionData or a bare clip space position, both are cut at exactly the same points
+    template <typename Vertex>
+    inline unsigned int clip_triangle(const Vertex *vertices, float guard_band, Vertex *polygon)
+    {
+        int outside_screen = ~0;
+        int clip_planes = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            outside_screen &= clip_outcode(clip_position(vertices[i]), 1.0f);
+            clip_planes |= clip_outcode(clip_position(vertices[i]), guard_band);
+            polygon[i] = vertices[i];
+        }
+        if (outside_screen != 0)
+        {
+            return 0;
+        }
+        if (clip_planes == 0)
+        {
+            return 3;
+        }
+
+        Vertex buffer[MAX_CLIPPED_VERTICES];
+        Vertex *in = polygon;
+        Vertex *out = buffer;
+        unsigned int count = 3;
+        for (int plane = CLIP_NEAR; plane <= CLIP_TOP; plane <<= 1)
+        {
+            if (!(clip_planes & plane))
+            {
+                continue;
+            }
+            unsigned int out_count = 0;
+            for (unsigned int i = 0; i < count; i++)
+            {
+                const Vertex &a = in[i];
+                const Vertex &b = in[(i + 1) % count];
+                float da = clip_distance(clip_position(a), plane, guard_band);
+                float db = clip_distance(clip_position(b), plane, guard_band);
+                if (da >= 0)
+                {
+                    out[out_count++] = a;
+                }
+                // always interpolate from the inside vertex so an edge shared by two triangles is cut at the same point
+                if (da >= 0 && db < 0)
+                {
+                    out[out_count++] = mix_vertex(a, b, da / (da - db));
+                }
+                else if (da < 0 && db >= 0)
+                {
+                    out[out_count++] = mix_vertex(b, a, db / (db - da));
+                }
+            }
+            std::swap(in, out);
+            count = out_count;
+            if (count < 3)
+            {
+                return 0;
+            }
+        }
+
+        if (in != polygon)
+        {
+            for (unsigned int i = 0; i < count; i++)
+            {
+                polygon[i] = in[i];
+            }
+        }
+        return count;
+    }
+
+    // true when the sphere is entirely outside one of the planes clip_triangle rejects against
+    inline bool sphere_outside_frustum(const glm::vec3 &center, float radius, const glm::mat4 &mvp)
+    {
+        glm::vec4 row[4];
+        for (int i = 0; i < 4; i++)
+        {
+            row[i] = glm::vec4(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+        }
+        const glm::vec4 planes[5] = {row[3] + row[2], row[3] + row[0], row[3] - row[0], row[3] + row[1], row[3] - row[1]};
+        for (int i = 0; i < 5; i++)
+        {
+            glm::vec3 normal(planes[i]);
+            if (glm::dot(normal, center) + planes[i].w < -radius * glm::length(normal))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // true when the mesh bounds are entirely outside one of the planes clip_triangle rejects against, so none of its faces can reach the screen
+    // the sphere is tested first since it is cheaper, then the eight corners of the box
+    inline bool bounds_outside_frustum(const MeshBounds &bounds, const glm::mat4 &mvp)
+    {
+        if (sphere_outside_frustum(bounds.center, bounds.radius, mvp))
+        {
+            return true;
+        }
+
+        int outside = ~0;
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec3 corner((i & 1) ? bounds.max.x : bounds.min.x, (i & 2) ? bounds.max.y : bounds.min.y, (i & 4) ? bounds.max.z : bounds.min.z);
+            outside &= clip_outcode(mvp * glm::vec4(corner, 1.0f), 1.0f);
+        }
+        return outside != 0;
+    }
+
+    // object space camera of mvp as the homogeneous point it maps to x = y = w = 0
+    // w is 1 for a perspective projection, under an orthographic one it is 0 and xyz is the viewing axis
+    inline glm::vec4 camera_object_position(const glm::mat4 &mvp)
+    {
+        const int rows[3] = {0, 1, 3};
+        float eye[4];
+        for (int i = 0; i < 4; i++)
+        {
+            glm::mat3 minor;
+            for (int r = 0; r < 3; r++)
+            {
+                for (int c = 0, column = 0; c < 4; c++)
+                {
+                    if (c != i)
+                    {
+                        minor[column++][r] = mvp[c][rows[r]];
+                    }
+                }
+            }
+            eye[i] = (i & 1 ? -1.0f : 1.0f) * glm::determinant(minor);
+        }
+        if (eye[3] != 0.0f)
+        {
+            return glm::vec4(eye[0] / eye[3], eye[1] / eye[3], eye[2] / eye[3], 1.0f);
+        }
+        return glm::vec4(eye[0], eye[1], eye[2], 0.0f);
+    }
+
+    // 1 when a face that turns its normal away from eye has a negative clip space det(x, y, w), -1 when mirroring flips that
+    inline float clip_winding_sign(const glm::mat4 &mvp, const glm::vec4 &eye)
+    {
+        // a test face per axis, placed so it faces eye when the axis allows it, the one facing it most decides
+        float facing = 0.0f, det = 0.0f;
+        for (int i = 0; i < 3; i++)
+        {
+            glm::vec3 n(0.0f), u(0.0f), v(0.0f);
+            n[i] = 1.0f;
+            u[(i + 1) % 3] = 1.0f;
+            v[(i + 2) % 3] = 1.0f;
+            glm::vec3 a = glm::vec3(eye) * eye.w - n * eye.w;
+            float f = glm::dot(n, glm::vec3(eye) - a * eye.w);
+            if (std::abs(f) > std::abs(facing))
+            {
+                glm::vec4 pa = mvp * glm::vec4(a, 1.0f), pb = mvp * glm::vec4(a + u, 1.0f), pc = mvp * glm::vec4(a + v, 1.0f);
+                facing = f;
+                det = glm::dot(glm::vec3(pa.x, pa.y, pa.w), glm::cross(glm::vec3(pb.x, pb.y, pb.w), glm::vec3(pc.x, pc.y, pc.w)));
+            }
+        }
+        return facing * det > 0.0f ? 1.0f : -1.0f;
+    }
+
+    // true when every face of cluster turns away from eye, or towards it for facing -1, tested on the normal cone instead of per face
+    inline bool cluster_faces_away(const MeshCluster &cluster, const glm::vec4 &eye, float facing)
+    {
+        glm::vec3 axis = cluster.cone_axis * facing;
+        if (eye.w == 0.0f)
+        {
+            glm::vec3 view = -glm::vec3(eye);
+            return glm::dot(view, axis) > cluster.cone_cutoff * glm::length(view);
+        }
+        glm::vec3 view = cluster.center - glm::vec3(eye);
+        return glm::dot(view, axis) > cluster.cone_cutoff * glm::length(view) + cluster.radius;
+    }
+
+    // deviation in object space that stays under pixels on a screen height pixels tall, measured where the bounding sphere comes closest to the camera
+    // 0 when the camera is inside the sphere, so the full mesh is drawn
+    inline float lod_max_error(const MeshBounds &bounds, const glm::mat4 &model, const glm::mat4 &mvp, const glm::mat4 &projection, unsigned int height, float pixels)
+    {
+        float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        // w is the view distance under a perspective projection and 1 under an orthographic one
+        float w = (mvp * glm::vec4(bounds.center, 1.0f)).w - bounds.radius * scale * std::abs(projection[2][3]);
+        if (w <= 0.0f || scale <= 0.0f)
+        {
+            return 0.0f;
+        }
+        float pixels_per_unit = std::abs(projection[1][1]) * height * 0.5f / w * scale;
+        return pixels / pixels_per_unit;
+    }
+
+    // levels of detail whose error projects under this many pixels are drawn instead of the full mesh
+    const float LOD_THRESHOLD_PIXELS = 1.0f;
+
+    // number of floats the interpolated varyings of ShaderFunctionData pack into: position, uv, uv2, normal and color
+    const int VARYING_COUNT = 14;
+
+    inline void pack_varyings(const ShaderFunctionData &data, float *out)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            out[i] = data.position[i];
+        }
+        out[4] = data.uv.x;
+        out[5] = data.uv.y;
+        out[6] = data.uv2.x;
+        out[7] = data.uv2.y;
+        for (int i = 0; i < 3; i++)
+        {
+            out[8 + i] = data.normal[i];
+            out[11 + i] = data.color[i];
+        }
+    }
+
+    inline void unpack_varyings(const float *in, ShaderFunctionData &data)
+    {
+        data.position = glm::vec4(in[0], in[1], in[2], in[3]);
+        data.uv = glm::vec2(in[4], in[5]);
+        data.uv2 = glm::vec2(in[6], in[7]);
+        data.normal = glm::vec3(in[8], in[9], in[10]);
+        data.color = glm::vec3(in[11], in[12], in[13]);
+    }
+
+    // symmetric 4x4 matrix of the quadric error metric, error(p) is the sum of squared distances from p to the planes added to it
+    struct Quadric
+    {
+        double a[10];
+
+        Quadric()
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                a[i] = 0.0;
+            }
+        }
+
+        void add_plane(const glm::vec3 &n, float d)
+        {
+            a[0] += n.x * n.x; a[1] += n.x * n.y; a[2] += n.x * n.z; a[3] += n.x * d;
+            a[4] += n.y * n.y; a[5] += n.y * n.z; a[6] += n.y * d;
+            a[7] += n.z * n.z; a[8] += n.z * d;
+            a[9] += d * d;
+        }
+
+        void add(const Quadric &q)
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                a[i] += q.a[i];
+            }
+        }
+
+        float error(const glm::vec3 &p) const
+        {
+            double x = p.x, y = p.y, z = p.z;
+            double e = a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x +
+                       a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y +
+                       a[7] * z * z + 2.0 * a[8] * z + a[9];
+            return (float)std::max(e, 0.0);
+        }
+    };
+
+    // quadric error simplification (Garland & Heckbert) by half-edge collapses
+    // a vertex only ever moves onto one of its neighbours, so the survivors keep their own uv, normal and color and need no interpolation
+    // vertices on a uv/normal seam or an open border never move, the mesh stays closed and textures do not tear
+    class MeshSimplifier
+    {
+    protected:
+        // candidate collapse of from onto to, stale once from has changed since it was pushed
+        struct Collapse
+        {
+            float cost;
+            unsigned int from;
+            unsigned int to;
+            unsigned int version;
+            bool operator<(const Collapse &other) const { return cost > other.cost; }
+        };
+
+        std::vector<unsigned int> faces;
+        std::vector<glm::vec3> positions;
+        // first vertex with the same position, vertices split by a uv or normal seam share it
+        std::vector<unsigned int> position_id;
+        std::vector<Quadric> quadrics;
+        std::vector<std::vector<unsigned int>> vertex_faces;
+        std::vector<bool> face_alive;
+        std::vector<bool> locked;
+        std::vector<bool> removed;
+        std::vector<unsigned int> version;
+        std::vector<Collapse> heap;
+        // scratch of can_collapse
+        std::vector<unsigned int> from_ring;
+        std::vector<unsigned int> to_ring;
+        std::vector<unsigned int> edge_opposite;
+
+        void push_collapse(unsigned int from, unsigned int to)
+        {
+            if (!locked[from] && from != to)
+            {
+                Collapse c = {quadrics[from].error(positions[to]), from, to, version[from]};
+                heap.push_back(c);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        // positions of the vertices sharing a live face with vertex, vertex itself left out
+        void ring_positions(unsigned int vertex, std::vector<unsigned int> &ring)
+        {
+            ring.clear();
+            const std::vector<unsigned int> &around = vertex_faces[vertex];
+            for (unsigned int i = 0; i < around.size(); i++)
+            {
+                if (!face_alive[around[i]])
+                {
+                    continue;
+                }
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int id = faces[around[i] * 3 + k];
+                    if (id != vertex)
+                    {
+                        ring.push_back(position_id[id]);
+                    }
+                }
+            }
+            std::sort(ring.begin(), ring.end());
+            ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+        }
+
+        // the edge may be gone already, moving from must not flip or flatten to zero area any face that survives the collapse
+        // and the collapse must keep the surface manifold: the only vertices next to both ends are the third vertices of the faces on the edge (link condition)
+        bool can_collapse(const Collapse &c)
+        {
+            bool shares_face = false;
+            edge_opposite.clear();
+            const std::vector<unsigned int> &around = vertex_faces[c.from];
+            for (unsigned int i = 0; i < around.size(); i++)
+            {
+                if (!face_alive[around[i]])
+                {
+                    continue;
+                }
+                const unsigned int *v = &faces[around[i] * 3];
+                if (v[0] == c.to || v[1] == c.to || v[2] == c.to)
+                {
+                    shares_face = true;
+                    for (int k = 0; k < 3; k++)
+                    {
+                        if (v[k] != c.from && v[k] != c.to)
+                        {
+                            edge_opposite.push_back(position_id[v[k]]);
+                        }
+                    }
+                    continue;
+                }
+                glm::vec3 p[3] = {positions[v[0]], positions[v[1]], positions[v[2]]};
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                for (int k = 0; k < 3; k++)
+                {
+                    if (v[k] == c.from)
+                    {
+                        p[k] = positions[c.to];
+                    }
+                }
+                glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+                // a face turned by more than about 75 degrees is folding over, one left with under a hundredth of its area is a sliver on its way to zero
+                float before_length2 = glm::dot(before, before), after_length2 = glm::dot(after, after);
+                if (glm::dot(before, after) <= 0.25f * std::sqrt(before_length2 * after_length2) || after_length2 <= 1e-4f * before_length2)
+                {
+                    return false;
+                }
+            }
+            if (!shares_face)
+            {
+                return false;
+            }
+
+            ring_positions(c.from, from_ring);
+            ring_positions(c.to, to_ring);
+            for (unsigned int i = 0, j = 0; i < from_ring.size() && j < to_ring.size();)
+            {
+                if (from_ring[i] < to_ring[j])
+                {
+                    i++;
+                }
+                else if (to_ring[j] < from_ring[i])
+                {
+                    j++;
+                }
+                else
+                {
+                    unsigned int shared = from_ring[i];
+                    if (shared != position_id[c.from] && shared != position_id[c.to] && std::find(edge_opposite.begin(), edge_opposite.end(), shared) == edge_opposite.end())
+                    {
+                        return false;
+                    }
+                    i++;
+                    j++;
+                }
+            }
+            return true;
+        }
+
+    public:
+        // simplifies source down to about target_face_count faces into out
+        // returns the largest distance a collapse moved the surface by, an object space estimate of how far out deviates from source
+        float simplify(Mesh &source, unsigned int target_face_count, Mesh &out)
+        {
+            const unsigned int vert_count = source.vert_count;
+            const unsigned int face_count = source.face_count;
+            const unsigned int unused = 0xffffffff;
+
+            // identical vertices of a de-indexed mesh are welded first, otherwise every vertex would look like a seam
+            std::vector<unsigned int> weld(vert_count);
+            position_id.assign(vert_count, 0);
+            {
+                std::map<std::vector<float>, unsigned int> unique_vertices;
+                std::map<std::vector<float>, unsigned int> unique_positions;
+                ShaderFunctionData data;
+                float varyings[VARYING_COUNT];
+                for (unsigned int i = 0; i < vert_count; i++)
+                {
+                    source.get_vertex_data(data, i);
+                    pack_varyings(data, varyings);
+                    std::vector<float> key(varyings, varyings + VARYING_COUNT);
+                    weld[i] = unique_vertices.insert(std::make_pair(key, i)).first->second;
+                    key.resize(3);
+                    position_id[i] = unique_positions.insert(std::make_pair(key, i)).first->second;
+                }
+            }
+
+            faces.resize(face_count * 3);
+            for (unsigned int i = 0; i < face_count * 3; i++)
+            {
+                faces[i] = weld[source.get_face_vertex(i / 3, i % 3)];
+            }
+
+            positions.resize(vert_count);
+            std::vector<unsigned int> position_users(vert_count, 0);
+            for (unsigned int i = 0; i < vert_count; i++)
+            {
+                positions[i] = glm::vec3(source.get_vertex_position(i));
+                if (weld[i] == i)
+                {
+                    position_users[position_id[i]]++;
+                }
+            }
+
+            locked.assign(vert_count, false);
+            for (unsigned int i = 0; i < vert_count; i++)
+            {
+                locked[i] = position_users[position_id[i]] > 1;
+            }
+            // an edge of the welded surface used by a single face is on an open border
+            std::map<std::pair<unsigned int, unsigned int>, int> edge_faces;
+            for (unsigned int i = 0; i < face_count * 3; i++)
+            {
+                unsigned int a = position_id[faces[i]], b = position_id[faces[i - i % 3 + (i + 1) % 3]];
+                edge_faces[std::make_pair(std::min(a, b), std::max(a, b))]++;
+            }
+            for (unsigned int i = 0; i < face_count * 3; i++)
+            {
+                unsigned int a = faces[i], b = faces[i - i % 3 + (i + 1) % 3];
+                if (edge_faces[std::make_pair(std::min(position_id[a], position_id[b]), std::max(position_id[a], position_id[b]))] == 1)
+                {
+                    locked[a] = true;
+                    locked[b] = true;
+                }
+            }
+
+            quadrics.assign(vert_count, Quadric());
+            vertex_faces.assign(vert_count, std::vector<unsigned int>());
+            face_alive.assign(face_count, true);
+            unsigned int alive_faces = face_count;
+            for (unsigned int f = 0; f < face_count; f++)
+            {
+                const unsigned int *v = &faces[f * 3];
+                glm::vec3 e[3] = {positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[1]], positions[v[0]] - positions[v[2]]};
+                glm::vec3 n = glm::cross(e[0], -e[2]);
+                float length = glm::length(n);
+                float longest = std::max(glm::dot(e[0], e[0]), std::max(glm::dot(e[1], e[1]), glm::dot(e[2], e[2])));
+                // faces of about zero area in the source cover no pixel, they are dropped instead of carried into every level
+                if (length <= 1e-6f * longest)
+                {
+                    face_alive[f] = false;
+                    alive_faces--;
+                    continue;
+                }
+                for (int k = 0; k < 3; k++)
+                {
+                    quadrics[v[k]].add_plane(n / length, -glm::dot(n / length, positions[v[0]]));
+                    vertex_faces[v[k]].push_back(f);
+                }
+            }
+
+            removed.assign(vert_count, false);
+            version.assign(vert_count, 0);
+            heap.clear();
+            for (unsigned int i = 0; i < face_count * 3; i++)
+            {
+                push_collapse(faces[i], faces[i - i % 3 + (i + 1) % 3]);
+                push_collapse(faces[i - i % 3 + (i + 1) % 3], faces[i]);
+            }
+
+            float max_error = 0.0f;
+            while (alive_faces > target_face_count && !heap.empty())
+            {
+                std::pop_heap(heap.begin(), heap.end());
+                Collapse c = heap.back();
+                heap.pop_back();
+                if (removed[c.from] || removed[c.to] || c.version != version[c.from] || !can_collapse(c))
+                {
+                    continue;
+                }
+
+                const std::vector<unsigned int> &around = vertex_faces[c.from];
+                for (unsigned int i = 0; i < around.size(); i++)
+                {
+                    unsigned int *v = &faces[around[i] * 3];
+                    if (!face_alive[around[i]])
+                    {
+                        continue;
+                    }
+                    if (v[0] == c.to || v[1] == c.to || v[2] == c.to)
+                    {
+                        face_alive[around[i]] = false;
+                        alive_faces--;
+                        continue;
+                    }
+                    for (int k = 0; k < 3; k++)
+                    {
+                        v[k] = v[k] == c.from ? c.to : v[k];
+                    }
+                    vertex_faces[c.to].push_back(around[i]);
+                }
+                removed[c.from] = true;
+                quadrics[c.to].add(quadrics[c.from]);
+                version[c.to]++;
+                max_error = std::max(max_error, c.cost);
+
+                const std::vector<unsigned int> &around_to = vertex_faces[c.to];
+                for (unsigned int i = 0; i < around_to.size(); i++)
+                {
+                    if (face_alive[around_to[i]])
+                    {
+                        for (int k = 0; k < 3; k++)
+                        {
+                            push_collapse(c.to, faces[around_to[i] * 3 + k]);
+                            push_collapse(faces[around_to[i] * 3 + k], c.to);
+                        }
+                    }
+                }
+            }
+
+            // compact the surviving faces and the vertices they still use
+            std::vector<unsigned int> remap(vert_count, unused);
+            out.vertex.clear();
+            out.uv.clear();
+            out.uv2.clear();
+            out.normal.clear();
+            out.color.clear();
+            out.index.clear();
+            out.invalidate_bounds();
+            for (unsigned int i = 0; i < face_count * 3; i++)
+            {
+                unsigned int id = faces[i];
+                if (!face_alive[i / 3])
+                {
+                    continue;
+                }
+                if (remap[id] == unused)
+                {
+                    remap[id] = out.vertex.size();
+                    out.vertex.push_back(glm::vec3(positions[id]));
+                    if (source.uv.size() > 0)
+                    {
+                        out.uv.push_back(source.uv[id]);
+                    }
+                    if (source.uv2.size() > 0)
+                    {
+                        out.uv2.push_back(source.uv2[id]);
+                    }
+                    if (source.normal.size() > 0)
+                    {
+                        out.normal.push_back(source.normal[id]);
+                    }
+                    if (source.color.size() > 0)
+                    {
+                        out.color.push_back(source.color[id]);
+                    }
+                }
+                out.index.push_back(remap[id]);
+            }
+            out.vert_count = out.vertex.size();
+            out.face_count = out.index.size() / 3;
+            return std::sqrt(max_error);
+        }
+    };
+
+    // source down to about target_face_count faces, see MeshSimplifier
+    inline float simplify_mesh(Mesh &source, unsigned int target_face_count, Mesh &out)
+    {
+        MeshSimplifier simplifier;
+        return simplifier.simplify(source, target_face_count, out);
+    }
+
+    // reorders the faces of an indexed mesh so a face mostly reuses vertices of the faces just before it (Tipsify, Sander et al. 2007)
+    // cache_size is the number of recent vertices the order is tuned to keep hot
+    inline void optimize_vertex_cache(Mesh &mesh, unsigned int cache_size = 16)
+    {
+        if (mesh.index.empty())
+        {
+            return;
+        }
+        const unsigned int vert_count = mesh.vert_count;
+        const unsigned int face_count = mesh.index.size() / 3;
+
+        // faces around every vertex, packed into one array
+        std::vector<unsigned int> live(vert_count, 0);
+        for (unsigned int i = 0; i < face_count * 3; i++)
+        {
+            live[mesh.index[i]]++;
+        }
+        std::vector<unsigned int> offset(vert_count + 1, 0);
+        for (unsigned int i = 0; i < vert_count; i++)
+        {
+            offset[i + 1] = offset[i] + live[i];
+        }
+        std::vector<unsigned int> vertex_faces(face_count * 3);
+        std::vector<unsigned int> fill(offset.begin(), offset.end() - 1);
+        for (unsigned int i = 0; i < face_count * 3; i++)
+        {
+            vertex_faces[fill[mesh.index[i]]++] = i / 3;
+        }
+
+        std::vector<unsigned int> timestamp(vert_count, 0);
+        std::vector<bool> emitted(face_count, false);
+        std::vector<unsigned int> dead_end;
+        std::vector<unsigned int> candidates;
+        std::vector<unsigned int> order;
+        order.reserve(face_count * 3);
+        unsigned int time = cache_size + 1;
+        unsigned int cursor = 0;
+        int fanning = 0;
+        while (fanning >= 0)
+        {
+            // emit every remaining face around the fanning vertex
+            candidates.clear();
+            for (unsigned int i = offset[fanning]; i < offset[fanning + 1]; i++)
+            {
+                unsigned int face = vertex_faces[i];
+                if (emitted[face])
+                {
+                    continue;
+                }
+                emitted[face] = true;
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int v = mesh.index[face * 3 + k];
+                    order.push_back(v);
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    live[v]--;
+                    if (time - timestamp[v] > cache_size)
+                    {
+                        timestamp[v] = time++;
+                    }
+                }
+            }
+
+            // next fan around the candidate that is still in the cache and will stay there while its faces are emitted
+            fanning = -1;
+            int best_priority = -1;
+            for (unsigned int i = 0; i < candidates.size(); i++)
+            {
+                unsigned int v = candidates[i];
+                if (live[v] == 0)
+                {
+                    continue;
+                }
+                int priority = 0;
+                if (time - timestamp[v] + 2 * live[v] <= cache_size)
+                {
+                    priority = time - timestamp[v];
+                }
+                if (priority > best_priority)
+                {
+                    best_priority = priority;
+                    fanning = v;
+                }
+            }
+
+            // dead end, fall back to recently used vertices and then to the next vertex in input order
+            while (fanning < 0 && !dead_end.empty())
+            {
+                unsigned int v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v] > 0)
+                {
+                    fanning = v;
+                }
+            }
+            for (; fanning < 0 && cursor < vert_count; cursor++)
+            {
+                if (live[cursor] > 0)
+                {
+                    fanning = cursor;
+                }
+            }
+        }
+        mesh.index.swap(order);
+    }
+
+    // sorts clusters of faces so the ones facing away from the mesh center come first
+    // such clusters tend to be in front whenever they are visible, so later faces fail the depth test instead of being shaded twice
+    // run after optimize_vertex_cache: a cluster only ends at a face sharing no vertex with the cache_size vertices before it, so the cache order inside and between clusters is kept
+    inline void optimize_overdraw(Mesh &mesh, unsigned int cache_size = 16, unsigned int min_cluster_size = 16)
+    {
+        if (mesh.index.empty())
+        {
+            return;
+        }
+        const unsigned int face_count = mesh.index.size() / 3;
+
+        std::vector<unsigned int> cluster_start;
+        std::vector<unsigned int> timestamp(mesh.vert_count, 0);
+        unsigned int time = cache_size + 1;
+        for (unsigned int f = 0; f < face_count; f++)
+        {
+            int misses = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = mesh.index[f * 3 + k];
+                if (time - timestamp[v] > cache_size)
+                {
+                    timestamp[v] = time++;
+                    misses++;
+                }
+            }
+            if (f == 0 || (misses == 3 && f - cluster_start.back() >= min_cluster_size))
+            {
+                cluster_start.push_back(f);
+            }
+        }
+        const unsigned int cluster_count = cluster_start.size();
+        cluster_start.push_back(face_count);
+
+        glm::vec3 mesh_center(0.0f);
+        float mesh_area = 0.0f;
+        std::vector<glm::vec3> cluster_center(cluster_count, glm::vec3(0.0f));
+        std::vector<glm::vec3> cluster_normal(cluster_count, glm::vec3(0.0f));
+        std::vector<float> cluster_area(cluster_count, 0.0f);
+        for (unsigned int i = 0; i < cluster_count; i++)
+        {
+            for (unsigned int f = cluster_start[i]; f < cluster_start[i + 1]; f++)
+            {
+                const glm::vec3 &a = mesh.vertex[mesh.index[f * 3]];
+                const glm::vec3 &b = mesh.vertex[mesh.index[f * 3 + 1]];
+                const glm::vec3 &c = mesh.vertex[mesh.index[f * 3 + 2]];
+                glm::vec3 normal = glm::cross(b - a, c - a);
+                float area = glm::length(normal);
+                glm::vec3 center = (a + b + c) * (area / 3.0f);
+                cluster_center[i] += center;
+                cluster_normal[i] += normal;
+                cluster_area[i] += area;
+                mesh_center += center;
+                mesh_area += area;
+            }
+        }
+        if (mesh_area > 0.0f)
+        {
+            mesh_center /= mesh_area;
+        }
+
+        std::vector<std::pair<float, unsigned int>> sorted(cluster_count);
+        for (unsigned int i = 0; i < cluster_count; i++)
+        {
+            float length = glm::length(cluster_normal[i]);
+            glm::vec3 center = cluster_area[i] > 0.0f ? cluster_center[i] / cluster_area[i] : mesh_center;
+            float key = length > 0.0f ? glm::dot(center - mesh_center, cluster_normal[i] / length) : 0.0f;
+            sorted[i] = std::make_pair(-key, i);
+        }
+        std::stable_sort(sorted.begin(), sorted.end());
+
+        std::vector<unsigned int> order;
+        order.reserve(mesh.index.size());
+        for (unsigned int i = 0; i < cluster_count; i++)
+        {
+            unsigned int cluster = sorted[i].second;
+            order.insert(order.end(), mesh.index.begin() + cluster_start[cluster] * 3, mesh.index.begin() + cluster_start[cluster + 1] * 3);
+        }
+        mesh.index.swap(order);
+    }
+
+    // renumbers the vertices of an indexed mesh in the order the faces first use them, so the vertex streams are read front to back
+    // only the streams of Mesh are reordered, a mesh with more per-vertex data such as SkinnedMesh must not be passed here
+    inline void optimize_vertex_fetch(Mesh &mesh)
+    {
+        if (mesh.index.empty())
+        {
+            return;
+        }
+        const unsigned int unused = 0xffffffff;
+        std::vector<unsigned int> remap(mesh.vert_count, unused);
+        std::vector<unsigned int> order;
+        for (unsigned int i = 0; i < mesh.index.size(); i++)
+        {
+            unsigned int &id = mesh.index[i];
+            if (remap[id] == unused)
+            {
+                remap[id] = order.size();
+                order.push_back(id);
+            }
+            id = remap[id];
+        }
+
+        Mesh source;
+        source.vertex.swap(mesh.vertex);
+        source.uv.swap(mesh.uv);
+        source.uv2.swap(mesh.uv2);
+        source.normal.swap(mesh.normal);
+        source.color.swap(mesh.color);
+        for (unsigned int i = 0; i < order.size(); i++)
+        {
+            mesh.vertex.push_back(source.vertex[order[i]]);
+            if (source.uv.size() > 0)
+            {
+                mesh.uv.push_back(source.uv[order[i]]);
+            }
+            if (source.uv2.size() > 0)
+            {
+                mesh.uv2.push_back(source.uv2[order[i]]);
+            }
+            if (source.normal.size() > 0)
+            {
+                mesh.normal.push_back(source.normal[order[i]]);
+            }
+            if (source.color.size() > 0)
+            {
+                mesh.color.push_back(source.color[order[i]]);
+            }
+        }
+        mesh.vert_count = mesh.vertex.size();
+    }
+
+    // one-time reorder of an indexed mesh for faster draws: cache friendly face order, less overdraw, then sequential vertex reads
+    inline void optimize_mesh(Mesh &mesh)
+    {
+        optimize_vertex_cache(mesh);
+        optimize_overdraw(mesh);
+        optimize_vertex_fetch(mesh);
+    }
+
+    // fills mesh.lods with up to max_levels coarser meshes, each with about ratio times the faces of the one before
+    // stops early once a level would drop under min_faces, the simplifier can no longer remove a tenth of the faces
+    // or the error of a level grows past max_relative_error times the bounding radius, such a level no longer looks like the mesh at any size
+    // every level gets the same optimize_mesh reorder as a loaded mesh
+    inline void build_lods(Mesh &mesh, unsigned int max_levels = 4, float ratio = 0.5f, unsigned int min_faces = 64, float max_relative_error = 0.5f)
+    {
+        mesh.lods.clear();
+        mesh.lod_error.clear();
+        Mesh *previous = &mesh;
+        float error = 0.0f;
+        const float max_error = max_relative_error * mesh.get_bounds().radius;
+        for (unsigned int level = 0; level < max_levels; level++)
+        {
+            unsigned int target = (unsigned int)(previous->face_count * ratio);
+            if (target < min_faces)
+            {
+                break;
+            }
+            std::shared_ptr<Mesh> lod = std::make_shared<Mesh>();
+            float level_error = simplify_mesh(*previous, target, *lod);
+            if (lod->face_count == 0 || lod->face_count > previous->face_count * 0.9f)
+            {
+                break;
+            }
+            // errors of successive levels add up, the sum bounds how far this level is from the full mesh
+            error += level_error;
+            if (error > max_error)
+            {
+                break;
+            }
+            optimize_mesh(*lod);
+            mesh.lods.push_back(lod);
+            mesh.lod_error.push_back(error);
+            previous = lod.get();
+        }
+    }
+
+    // splits the faces of an indexed mesh into clusters of at most max_faces neighbouring faces, each with a bounding sphere and a normal cone
+    // a cluster grows from the first face not taken yet through faces sharing a position with it, then keeps the face order it had, so optimize_mesh order survives
+    // faces are reordered so every cluster is one range, rebuild after changing index
+    inline void build_clusters(Mesh &mesh, unsigned int max_faces = 64)
+    {
+        mesh.clusters.clear();
+        if (mesh.index.empty())
+        {
+            return;
+        }
+        const unsigned int face_count = mesh.index.size() / 3;
+
+        std::vector<unsigned int> position_id(mesh.vert_count);
+        {
+            std::map<std::vector<float>, unsigned int> unique_positions;
+            for (unsigned int i = 0; i < mesh.vert_count; i++)
+            {
+                std::vector<float> key(&mesh.vertex[i].x, &mesh.vertex[i].x + 3);
+                position_id[i] = unique_positions.insert(std::make_pair(key, i)).first->second;
+            }
+        }
+        std::vector<std::vector<unsigned int>> position_faces(mesh.vert_count);
+        for (unsigned int i = 0; i < face_count * 3; i++)
+        {
+            position_faces[position_id[mesh.index[i]]].push_back(i / 3);
+        }
+
+        std::vector<bool> taken(face_count, false);
+        std::vector<unsigned int> cluster_faces;
+        std::vector<unsigned int> order;
+        order.reserve(mesh.index.size());
+        for (unsigned int seed = 0; seed < face_count; seed++)
+        {
+            if (taken[seed])
+            {
+                continue;
+            }
+            // breadth first, so the cluster stays round and its sphere small
+            cluster_faces.clear();
+            cluster_faces.push_back(seed);
+            taken[seed] = true;
+            for (unsigned int next = 0; next < cluster_faces.size() && cluster_faces.size() < max_faces; next++)
+            {
+                for (int k = 0; k < 3 && cluster_faces.size() < max_faces; k++)
+                {
+                    const std::vector<unsigned int> &around = position_faces[position_id[mesh.index[cluster_faces[next] * 3 + k]]];
+                    for (unsigned int i = 0; i < around.size() && cluster_faces.size() < max_faces; i++)
+                    {
+                        if (!taken[around[i]])
+                        {
+                            taken[around[i]] = true;
+                            cluster_faces.push_back(around[i]);
+                        }
+                    }
+                }
+            }
+            std::sort(cluster_faces.begin(), cluster_faces.end());
+
+            MeshCluster cluster;
+            cluster.first_face = order.size() / 3;
+            cluster.face_count = cluster_faces.size();
+            glm::vec3 box_min = mesh.vertex[mesh.index[seed * 3]], box_max = box_min;
+            glm::vec3 normal_sum(0.0f);
+            for (unsigned int i = 0; i < cluster_faces.size(); i++)
+            {
+                const unsigned int *v = &mesh.index[cluster_faces[i] * 3];
+                for (int k = 0; k < 3; k++)
+                {
+                    order.push_back(v[k]);
+                    box_min = glm::min(box_min, mesh.vertex[v[k]]);
+                    box_max = glm::max(box_max, mesh.vertex[v[k]]);
+                }
+                glm::vec3 n = glm::cross(mesh.vertex[v[1]] - mesh.vertex[v[0]], mesh.vertex[v[2]] - mesh.vertex[v[0]]);
+                float length = glm::length(n);
+                normal_sum += length > 0.0f ? n / length : n;
+            }
+
+            cluster.center = (box_min + box_max) * 0.5f;
+            float radius2 = 0.0f;
+            for (unsigned int i = cluster.first_face * 3; i < order.size(); i++)
+            {
+                glm::vec3 d = mesh.vertex[order[i]] - cluster.center;
+                radius2 = std::max(radius2, glm::dot(d, d));
+            }
+            cluster.radius = std::sqrt(radius2);
+
+            // the cone holds every face normal, its cutoff is the sine of its half angle
+            float length = glm::length(normal_sum);
+            cluster.cone_axis = length > 0.0f ? normal_sum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+            float min_dot = length > 0.0f ? 1.0f : -1.0f;
+            for (unsigned int i = cluster.first_face * 3; i < order.size(); i += 3)
+            {
+                glm::vec3 n = glm::cross(mesh.vertex[order[i + 1]] - mesh.vertex[order[i]], mesh.vertex[order[i + 2]] - mesh.vertex[order[i]]);
+                float n_length = glm::length(n);
+                min_dot = n_length > 0.0f ? std::min(min_dot, glm::dot(cluster.cone_axis, n) / n_length) : min_dot;
+            }
+            cluster.cone_cutoff = min_dot > 0.0f ? std::sqrt(1.0f - min_dot * min_dot) : 1.0f;
+            mesh.clusters.push_back(cluster);
+        }
+        mesh.index.swap(order);
+    }
+
+    // varyings of a triangle divided by w, as planes over the barycentric weights of its second and third vertex
+    // set up once per triangle, a fragment then costs two multiply-adds per component and one division to undo the perspective
+    // only the varyings in mask get planes, packed to the front in pack_varyings order
+    struct VaryingPlanes
+    {
+        unsigned int mask;
+        float origin[VARYING_COUNT + 1];
+        float d1[VARYING_COUNT + 1];
+        float d2[VARYING_COUNT + 1];
+
+        void setup(const ShaderFunctionData &a, const ShaderFunctionData &b, const ShaderFunctionData &c, unsigned int varyings)
+        {
+            static const int first[5] = {0, 4, 6, 8, 11};
+            static const int size[5] = {4, 2, 2, 3, 3};
+            if (varyings & VARYING_UV_DERIVATIVES)
+            {
+                varyings |= VARYING_UV;
+            }
+            mask = varyings;
+            int count = 0;
+            unsigned char component[VARYING_COUNT];
+            for (int v = 0; v < 5; v++)
+            {
+                if (varyings & (1 << v))
+                {
+                    for (int i = 0; i < size[v]; i++)
+                    {
+                        component[count++] = first[v] + i;
+                    }
+                }
+            }
+
+            float va[VARYING_COUNT], vb[VARYING_COUNT], vc[VARYING_COUNT];
+            pack_varyings(a, va);
+            pack_varyings(b, vb);
+            pack_varyings(c, vc);
+            float inv_wa = 1.0f / a.position.w;
+            float inv_wb = 1.0f / b.position.w;
+            float inv_wc = 1.0f / c.position.w;
+            for (int k = 0; k < count; k++)
+            {
+                int i = component[k];
+                origin[k] = va[i] * inv_wa;
+                d1[k] = vb[i] * inv_wb - origin[k];
+                d2[k] = vc[i] * inv_wc - origin[k];
+            }
+            origin[VARYING_COUNT] = inv_wa;
+            d1[VARYING_COUNT] = inv_wb - inv_wa;
+            d2[VARYING_COUNT] = inv_wc - inv_wa;
+        }
+
+        float value(int k, float b1, float b2, float w) const { return (origin[k] + b1 * d1[k] + b2 * d2[k]) * w; }
+
+        // uv alone, for the neighbouring pixels uv derivatives are taken against
+        glm::vec2 uv_at(float b1, float b2) const
+        {
+            float w = 1.0f / (origin[VARYING_COUNT] + b1 * d1[VARYING_COUNT] + b2 * d2[VARYING_COUNT]);
+            int k = (mask & VARYING_POSITION) ? 4 : 0;
+            return glm::vec2(value(k, b1, b2, w), value(k + 1, b1, b2, w));
+        }
+
+        // writes only the set up varyings, the other fields of data are left as they are
+        void interpolate(float b1, float b2, ShaderFunctionData &data) const
+        {
+            float w = 1.0f / (origin[VARYING_COUNT] + b1 * d1[VARYING_COUNT] + b2 * d2[VARYING_COUNT]);
+            int k = 0;
+            if (mask & VARYING_POSITION)
+            {
+                data.position = glm::vec4(value(k, b1, b2, w), value(k + 1, b1, b2, w), value(k + 2, b1, b2, w), value(k + 3, b1, b2, w));
+                k += 4;
+            }
+            if (mask & VARYING_UV)
+            {
+                data.uv = glm::vec2(value(k, b1, b2, w), value(k + 1, b1, b2, w));
+                k += 2;
+            }
+            if (mask & VARYING_UV2)
+            {
+                data.uv2 = glm::vec2(value(k, b1, b2, w), value(k + 1, b1, b2, w));
+                k += 2;
+            }
+            if (mask & VARYING_NORMAL)
+            {
+                data.normal = glm::vec3(value(k, b1, b2, w), value(k + 1, b1, b2, w), value(k + 2, b1, b2, w));
+                k += 3;
+            }
+            if (mask & VARYING_COLOR)
+            {
+                data.color = glm::vec3(value(k, b1, b2, w), value(k + 1, b1, b2, w), value(k + 2, b1, b2, w));
+            }
+        }
+
+        // the same into one lane of a packet
+        void interpolate(float b1, float b2, FragmentPacket &packet, int lane) const
+        {
+            float w = 1.0f / (origin[VARYING_COUNT] + b1 * d1[VARYING_COUNT] + b2 * d2[VARYING_COUNT]);
+            int k = 0;
+            if (mask & VARYING_POSITION)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    packet.position[i][lane] = value(k++, b1, b2, w);
+                }
+            }
+            if (mask & VARYING_UV)
+            {
+                for (int i = 0; i < 2; i++)
+                {
+                    packet.uv[i][lane] = value(k++, b1, b2, w);
+                }
+            }
+            if (mask & VARYING_UV2)
+            {
+                for (int i = 0; i < 2; i++)
+                {
+                    packet.uv2[i][lane] = value(k++, b1, b2, w);
+                }
+            }
+            if (mask & VARYING_NORMAL)
+            {
+                glm::vec3 normal = glm::normalize(glm::vec3(value(k, b1, b2, w), value(k + 1, b1, b2, w), value(k + 2, b1, b2, w)));
+                k += 3;
+                for (int i = 0; i < 3; i++)
+                {
+                    packet.normal[i][lane] = normal[i];
+                }
+            }
+            if (mask & VARYING_COLOR)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    packet.color[i][lane] = value(k++, b1, b2, w);
+                }
+            }
+        }
+    };
+
+    // the vertex stage output of a whole mesh, one contiguous stream per component in the pack_varyings layout
+    // streams 0 to 3 are the clip space position, so passes that only need positions never touch the other streams
+    struct TransformedVertices
+    {
+        unsigned int count = 0;
+        std::vector<float> streams[VARYING_COUNT];
+
+        void resize(unsigned int size)
+        {
+            count = size;
+            for (int i = 0; i < VARYING_COUNT; i++)
+            {
+                streams[i].resize(size);
+            }
+        }
+
+        void set(const unsigned int id, const ShaderFunctionData &data)
+        {
+            float values[VARYING_COUNT];
+            pack_varyings(data, values);
+            for (int i = 0; i < VARYING_COUNT; i++)
+            {
+                streams[i][id] = values[i];
+            }
+        }
+
+        // fills the streams straight from the vertex memory of a mesh, one strided copy per component
+        // components the layout does not provide get the ShaderFunctionData defaults
+        void fetch(const VertexLayout &layout, unsigned int size)
+        {
+            static const int first_stream[ATTRIBUTE_COUNT] = {0, 4, 6, 8, 11};
+            static const int stream_count[ATTRIBUTE_COUNT] = {4, 2, 2, 3, 3};
+            resize(size);
+            for (int a = 0; a < ATTRIBUTE_COUNT; a++)
+            {
+                const VertexAttributeLayout &attribute = layout.attributes[a];
+                for (int c = 0; c < stream_count[a]; c++)
+                {
+                    float *out = size > 0 ? &streams[first_stream[a] + c][0] : NULL;
+                    if (attribute.data == NULL || c >= attribute.format)
+                    {
+                        std::fill(out, out + size, (a == ATTRIBUTE_POSITION && c == 3) ? 1.0f : 0.0f);
+                        continue;
+                    }
+                    const unsigned char *in = (const unsigned char *)attribute.data + attribute.offset + c * sizeof(float);
+                    const unsigned int stride = attribute.stride;
+                    for (unsigned int i = 0; i < size; i++)
+                    {
+                        out[i] = *(const float *)(in + i * stride);
+                    }
+                }
+            }
+        }
+
+        glm::vec4 get_position(const unsigned int id) const
+        {
+            return glm::vec4(streams[0][id], streams[1][id], streams[2][id], streams[3][id]);
+        }
+
+        void get(const unsigned int id, ShaderFunctionData &data) const
+        {
+            float values[VARYING_COUNT];
+            for (int i = 0; i < VARYING_COUNT; i++)
+            {
+                values[i] = streams[i][id];
+            }
+            unpack_varyings(values, data);
+        }
+    };
+
+    // a triangle after the vertex stage, ready to be rasterized inside any screen rectangle
+    struct RasterTriangle
+    {
+        VaryingPlanes varyings;
+        glm::vec3 points[3];
+        TriangleEdges edges;
+        glm::ivec2 bboxmin;
+        glm::ivec2 bboxmax;
+    };
+
+    // visibility buffer value of a pixel no triangle has been drawn to
+    const unsigned int NO_TRIANGLE = 0xffffffff;
+
+    class OcclusionDetector
+    {
+    protected:
+        unsigned int width;
+        unsigned int height;
+        std::vector<float> zbuffer;
+        glm::mat4 view_matrix;
+        glm::mat4 projection_matrix;
+        bool zbuffer_write = true;
+        std::function<bool(unsigned int, float)> deep_check_func;
+        DeephMode deeph_mode = DeephMode::NONE;
+        // level of detail pick of check_mesh, lod_screen_height 0 measures lod_threshold in pixels of this detector
+        float lod_threshold = LOD_THRESHOLD_PIXELS;
+        unsigned int lod_screen_height = 0;
+
+    public:
+        bool deep_check_none(unsigned int idx, float value) { return true; }
+        bool deep_check_less(unsigned int idx, float value)
+        {
+
+            if (zbuffer[idx] < value)
+            {
+                if (zbuffer_write)
+                {
+                    zbuffer[idx] = value;
+                }
+
+                return true;
+            }
+            return false;
+        }
+        bool deep_check_greater(unsigned int idx, float value)
+        {
+            if (zbuffer[idx] > value)
+            {
+                if (zbuffer_write)
+                {
+                    zbuffer[idx] = value;
+                }
+                return true;
+            }
+            return false;
+        }
+        bool deep_check_less_equal(unsigned int idx, float value)
+        {
+            if (zbuffer[idx] <= value)
+            {
+                if (zbuffer_write)
+                {
+                    zbuffer[idx] = value;
+                }
+                return true;
+            }
+            return false;
+        }
+        bool deep_check_greater_equal(unsigned int idx, float value)
+        {
+            if (zbuffer[idx] >= value)
+            {
+                if (zbuffer_write)
+                {
+                    zbuffer[idx] = value;
+                }
+                return true;
+            }
+            return false;
+        }
+        bool deep_check_equal(unsigned int idx, float value)
+        {
+            if (zbuffer[idx] == value)
+            {
+                if (zbuffer_write)
+                {
+                    zbuffer[idx] = value;
+                }
+                return true;
+            }
+            return false;
+        }
+        bool calculate_deep_check(unsigned int idx, float value)
+        {
+            return deep_check_func(idx, value);
+        }
+
+        glm::vec3 calculate_screen_position(const glm::vec3 &vertex, const glm::mat4 &model_transform_matrix)
+        {
+
+            glm::mat4 mvp = projection_matrix * view_matrix * model_transform_matrix;
+
+            glm::vec4 clip_space_pos = mvp * glm::vec4(vertex, 1.0);
+
+            glm::vec3 space_pos;
+            space_pos.x = clip_space_pos.x / clip_space_pos.w;
+            space_pos.y = clip_space_pos.y / clip_space_pos.w;
+            space_pos.z = clip_space_pos.z / clip_space_pos.w;
+
+            glm::vec3 screenSpacePos;
+            screenSpacePos.x = (space_pos.x + 1.0f) * 0.5f * width;
+            screenSpacePos.y = (1.0f - space_pos.y) * 0.5f * height;
+            screenSpacePos.z = 1.0f - space_pos.z;
+
+            return screenSpacePos;
+        }
+
+        glm::vec3 calculate_screen_position_from_point(const glm::vec4 &pos)
+        {
+
+            glm::vec4 clip_space_pos = pos;
+
+            glm::vec3 space_pos;
+            space_pos.x = clip_space_pos.x / clip_space_pos.w;
+            space_pos.y = clip_space_pos.y / clip_space_pos.w;
+            space_pos.z = clip_space_pos.z / clip_space_pos.w;
+
+            glm::vec3 screenSpacePos;
+            screenSpacePos.x = (space_pos.x + 1.0f) * 0.5f * width;
+            screenSpacePos.y = (1.0f - space_pos.y) * 0.5f * height;
+            screenSpacePos.z = 1.0f - space_pos.z;
+
+            return screenSpacePos;
+        }
+
+        void vertex_shader(ShaderFunctionData &data, const ShaderUniforms &uniforms)
+        {
+            data.position = uniforms.mvp * data.position;
+        }
+
+        bool check_triangle(MeshBase &mesh, const unsigned int face_id, const ShaderUniforms &uniforms)
+        {
+            bool ret = false;
+            ShaderFunctionData vertex_data[3];
+
+            for (int i = 0; i < 3; i++)
+            {
+
+                mesh.get_vertex_data(vertex_data[i], mesh.get_face_vertex(face_id, i));
+                vertex_shader(vertex_data[i], uniforms);
+            }
+
+            ShaderFunctionData polygon[MAX_CLIPPED_VERTICES];
+            unsigned int count = clip_triangle(vertex_data, guard_band_scale(width, height), polygon);
+            for (unsigned int i = 1; i + 1 < count; i++)
+            {
+                glm::vec3 points[3];
+                points[0] = calculate_screen_position_from_point(polygon[0].position);
+                points[1] = calculate_screen_position_from_point(polygon[i].position);
+                points[2] = calculate_screen_position_from_point(polygon[i + 1].position);
+                if (check_raster_triangle(points))
+                {
+                    ret = true;
+                    if (!zbuffer_write)
+                    {
+                        return true;
+                    }
+                }
+            }
+            return ret;
+        }
+
+        bool check_raster_triangle(const glm::vec3 *points)
+        {
+            bool ret = false;
+            glm::ivec2 bboxmin(width - 1, height - 1);
+            glm::ivec2 bboxmax(0, 0);
+            glm::ivec2 clamp(width - 1, height - 1);
+
+            for (int i = 0; i < 3; i++)
+            {
                 bboxmin.x = std::max(0, (int)std::min(bboxmin.x, (int)points[i].x));
                 bboxmin.y = std::max(0, (int)std::min(bboxmin.y, (int)points[i].y));
 
                 bboxmax.x = std::min(clamp.x, std::max(bboxmax.x, (int)points[i].x));
                 bboxmax.y = std::min(clamp.y, std::max(bboxmax.y, (int)points[i].y));
             }
-            glm::vec3 P;
-            for (P.x = bboxmin.x; P.x <= bboxmax.x; P.x++)
+            TriangleEdges edges;
+            if (!edges.setup(points))
+            {
+                return false;
+            }
+
+#ifdef TSRPA_SSE2
+            bool simd = edges.fits_int32(bboxmin, bboxmax);
+#endif
+            for (int y = bboxmin.y; y <= bboxmax.y; y++)
             {
-                for (P.y = bboxmin.y; P.y <= bboxmax.y; P.y++)
+                int x = bboxmin.x;
+                unsigned int idx = (unsigned int)y * width + x;
+#ifdef TSRPA_SSE2
+                if (simd)
+                {
+                    __m128i e[3], step[3];
+                    raster_span_4_setup(edges, x, y, e, step);
+                    for (; x + 3 <= bboxmax.x; x += 4, idx += 4)
+                    {
+                        float bc[12];
+                        if (raster_span_4(e, edges, points, &zbuffer[idx], deeph_mode, zbuffer_write, bc))
+                        {
+                            ret = true;
+                            if (!zbuffer_write)
+                            {
+                                return true;
+                            }
+                        }
+                        for (int i = 0; i < 3; i++)
+                        {
+                            e[i] = _mm_add_epi32(e[i], step[i]);
+                        }
+                    }
+                }
+#endif
+                long long e[3] = {edges.at(0, x, y), edges.at(1, x, y), edges.at(2, x, y)};
+                for (; x <= bboxmax.x; x++, idx++, e[0] += edges.step_x[0], e[1] += edges.step_x[1], e[2] += edges.step_x[2])
                 {
-                    glm::vec3 bc_screen = barycentric(points, P);
-                    if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0)
+                    if (!edges.covers(e))
                     {
                         continue;
                     }
 
-                    P.z = 0;
+                    glm::vec3 bc_screen = edges.barycentric(e);
+                    float z = 0;
                     for (int i = 0; i < 3; i++)
                     {
-                        P.z += points[i][2] * bc_screen[i];
+                        z += points[i][2] * bc_screen[i];
                     }
-                    if (calculate_deep_check(int(P.x + P.y * width), P.z))
+                    if (calculate_deep_check(idx, z))
                     {
                         ret = true;
                         if (!zbuffer_write)
@@ -337,6 +2390,7 @@ namespace TSRPA
             this->height = height;
 
             zbuffer.resize(this->width * this->height);
+            set_deeph_mode(DeephMode::NONE);
         }
 
         DeephMode get_deeph_mode() { return deeph_mode; }
@@ -354,6 +2408,15 @@ namespace TSRPA
             case 2:
                 deep_check_func = std::bind(&OcclusionDetector::deep_check_greater, this, std::placeholders::_1, std::placeholders::_2);
                 break;
+            case 3:
+                deep_check_func = std::bind(&OcclusionDetector::deep_check_less_equal, this, std::placeholders::_1, std::placeholders::_2);
+                break;
+            case 4:
+                deep_check_func = std::bind(&OcclusionDetector::deep_check_greater_equal, this, std::placeholders::_1, std::placeholders::_2);
+                break;
+            case 5:
+                deep_check_func = std::bind(&OcclusionDetector::deep_check_equal, this, std::placeholders::_1, std::placeholders::_2);
+                break;
             }
         }
 
@@ -366,6 +2429,15 @@ namespace TSRPA
         glm::mat4 get_projection_matrix() { return projection_matrix; }
         void set_projection_matrix(const glm::mat4 &mat) { projection_matrix = mat; }
 
+        // makes check_mesh test the level of detail a renderer screen_height pixels tall with lod threshold pixels draws
+        // pass its get_lod_threshold() and get_height(), the detector is usually much smaller than the screen and would pick a coarser level on its own
+        float get_lod_threshold() { return lod_threshold; }
+        void set_lod_threshold(float pixels, unsigned int screen_height = 0)
+        {
+            lod_threshold = std::max(0.0f, pixels);
+            lod_screen_height = screen_height;
+        }
+
         void clear()
         {
             for (unsigned int i = 0; i < zbuffer.size(); i++)
@@ -374,21 +2446,89 @@ namespace TSRPA
             }
         }
 
-        bool check_mesh(MeshBase &mesh, glm::mat4 &transform)
+        // false when the sphere, in the space of transform, fails the depth test on every pixel of the screen rectangle around it
+        // the test uses the depth of the point of the sphere closest to the camera and writes nothing, only LESS and LESS_EQUAL can prove a sphere hidden
+        bool check_sphere(const glm::vec3 &center, float radius, const glm::mat4 &transform)
         {
-            bool ret = false;
-            glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(transform)));
-            for (unsigned int i = 0; i < mesh.face_count; i++)
+            if (deeph_mode != DeephMode::LESS && deeph_mode != DeephMode::LESS_EQUAL)
+            {
+                return true;
+            }
+            glm::mat4 model_view = view_matrix * transform;
+            float scale = std::max(glm::length(glm::vec3(model_view[0])), std::max(glm::length(glm::vec3(model_view[1])), glm::length(glm::vec3(model_view[2]))));
+            glm::vec3 view_center(model_view * glm::vec4(center, 1.0f));
+            float view_radius = radius * scale;
+
+            glm::vec4 nearest = projection_matrix * glm::vec4(view_center.x, view_center.y, view_center.z + view_radius, 1.0f);
+            if (nearest.w <= 0.0f)
+            {
+                return true;
+            }
+            float z = 1.0f - nearest.z / nearest.w;
+
+            glm::vec2 rect_min(0.0f), rect_max(0.0f);
+            for (int i = 0; i < 8; i++)
             {
-                if (check_triangle(mesh, i, transform, normal_matrix))
+                glm::vec3 corner = view_center + glm::vec3(i & 1 ? view_radius : -view_radius, i & 2 ? view_radius : -view_radius, i & 4 ? view_radius : -view_radius);
+                glm::vec4 clip = projection_matrix * glm::vec4(corner, 1.0f);
+                if (clip.w <= 0.0f)
                 {
-                    ret = true;
-                    if (!zbuffer_write)
+                    return true;
+                }
+                glm::vec2 screen((clip.x / clip.w + 1.0f) * 0.5f * width, (1.0f - clip.y / clip.w) * 0.5f * height);
+                rect_min = i == 0 ? screen : glm::min(rect_min, screen);
+                rect_max = i == 0 ? screen : glm::max(rect_max, screen);
+            }
+            int x_min = std::max(0, (int)std::floor(rect_min.x)), x_max = std::min((int)width - 1, (int)std::ceil(rect_max.x));
+            int y_min = std::max(0, (int)std::floor(rect_min.y)), y_max = std::min((int)height - 1, (int)std::ceil(rect_max.y));
+            for (int y = y_min; y <= y_max; y++)
+            {
+                for (int x = x_min; x <= x_max; x++)
+                {
+                    float depth = zbuffer[y * width + x];
+                    if (depth < z || (deeph_mode == DeephMode::LESS_EQUAL && depth == z))
                     {
                         return true;
                     }
                 }
             }
+            return false;
+        }
+
+        bool check_mesh(MeshBase &full_mesh, glm::mat4 &transform)
+        {
+            ShaderUniforms uniforms(transform, view_matrix, projection_matrix);
+            if (bounds_outside_frustum(full_mesh.get_bounds(), uniforms.mvp))
+            {
+                return false;
+            }
+            // the same pick as SingleThreadRenderer::select_lod, so the answer is about the faces that get drawn
+            unsigned int lod_height = lod_screen_height > 0 ? lod_screen_height : height;
+            MeshBase &mesh = lod_threshold <= 0.0f ? full_mesh : full_mesh.select_lod(lod_max_error(full_mesh.get_bounds(), transform, uniforms.mvp, projection_matrix, lod_height, lod_threshold));
+            MeshCluster whole = mesh.whole_cluster();
+            const std::vector<MeshCluster> &clusters = mesh.get_clusters();
+            unsigned int cluster_count = std::max((unsigned int)clusters.size(), 1u);
+            bool ret = false;
+            for (unsigned int c = 0; c < cluster_count; c++)
+            {
+                // no face of a cluster outside the frustum or behind the zbuffer could pass, so its faces are skipped as a whole
+                const MeshCluster &cluster = clusters.empty() ? whole : clusters[c];
+                if (!clusters.empty() && (sphere_outside_frustum(cluster.center, cluster.radius, uniforms.mvp) || !check_sphere(cluster.center, cluster.radius, transform)))
+                {
+                    continue;
+                }
+                for (unsigned int i = cluster.first_face; i < cluster.first_face + cluster.face_count; i++)
+                {
+                    if (check_triangle(mesh, i, uniforms))
+                    {
+                        ret = true;
+                        if (!zbuffer_write)
+                        {
+                            return true;
+                        }
+                    }
+                }
+            }
             return ret;
         }
     };
@@ -400,24 +2540,37 @@ namespace TSRPA
         BACK = 2
     };
 
+    // how a shaded fragment is written to the frame buffer
+    enum BlendMode
+    {
+        // fragments with alpha below 1 are mixed with the frame buffer by their alpha
+        BLEND_ALPHA = 0,
+        // the fragment colour replaces the frame buffer as is
+        BLEND_NONE = 1,
+    };
+
+    // the fixed function state of a draw as one value, set_pipeline_state picks the raster loops specialised for it
+    // once per state change, so no pixel tests the depth mode, depth write or blend mode again
+    struct PipelineState
+    {
+        DeephMode depth_mode;
+        bool depth_write;
+        ShowFaces cull_mode;
+        BlendMode blend_mode;
+
+        PipelineState(DeephMode depth_mode = DeephMode::NONE, bool depth_write = true, ShowFaces cull_mode = ShowFaces::BACK, BlendMode blend_mode = BLEND_ALPHA)
+            : depth_mode(depth_mode), depth_write(depth_write), cull_mode(cull_mode), blend_mode(blend_mode) {}
+    };
+
     class Renderer
     {
     protected:
-        virtual bool deep_check_none(unsigned int idx, float value) { return false; }
-        virtual bool deep_check_less(unsigned int idx, float value) { return false; }
-
-        virtual bool deep_check_greater(unsigned int idx, float value) { return false; }
-
-        virtual bool calculate_deep_check(unsigned int idx, float value) { return false; }
-
         virtual void clear_zbuffer() {}
 
         virtual glm::vec3 calculate_screen_position(const glm::vec3 &vertex, const glm::mat4 &model_transform_matrix) { return glm::vec3(0.0f); }
 
         virtual glm::vec3 calculate_screen_position_from_point(const glm::vec4 &pos) { return glm::vec4(0.0f); }
 
-        virtual glm::vec3 barycentric(const glm::vec3 *pts, const glm::vec3 &P) { return glm::vec3(0.0f); }
-
         virtual void draw_shaded_triangle(MeshBase &mesh, const unsigned int face_id, Material &material, const glm::mat4 &transform, const glm::mat3 &normal_matrix) {}
 
     public:
@@ -444,6 +2597,28 @@ namespace TSRPA
         virtual DeephMode get_deeph_mode() { return DeephMode::NONE; }
         virtual void set_deeph_mode(DeephMode mode) {}
 
+        virtual BlendMode get_blend_mode() { return BLEND_ALPHA; }
+        virtual void set_blend_mode(BlendMode mode) {}
+
+        virtual PipelineState get_pipeline_state() { return PipelineState(); }
+        virtual void set_pipeline_state(const PipelineState &state) {}
+
+        virtual bool get_tile_binning() { return false; }
+        virtual void set_tile_binning(bool on) {}
+
+        virtual unsigned int get_tile_size() { return 0; }
+        virtual void set_tile_size(unsigned int size) {}
+
+        virtual bool get_visibility_buffer() { return false; }
+        virtual void set_visibility_buffer(bool on) {}
+        virtual void resolve_visibility_buffer() {}
+
+        virtual float get_lod_threshold() { return 0.0f; }
+        virtual void set_lod_threshold(float pixels) {}
+
+        virtual OcclusionDetector *get_occlusion_detector() { return NULL; }
+        virtual void set_occlusion_detector(OcclusionDetector *detector) {}
+
         Renderer() {}
 
         virtual unsigned char *get_result() { return NULL; }
@@ -463,6 +2638,18 @@ namespace TSRPA
         virtual void draw_basic_triangle(glm::ivec2 a, glm::ivec2 b, glm::ivec2 c, const glm::ivec4 &color) {}
 
         virtual void draw_shaded_mesh(MeshBase &mesh, Material &material, glm::mat4 &transform) {}
+
+        virtual void draw_shaded_mesh_instanced(MeshBase &mesh, Material &material, const glm::mat4 *transforms, unsigned int count, const void *instance_data = NULL, unsigned int instance_stride = 0) {}
+
+        virtual void draw_depth_only(MeshBase &mesh, const glm::mat4 &transform) {}
+
+        virtual void transform_mesh(MeshBase &mesh, Material &material, const glm::mat4 &transform, TransformedVertices &vertices) {}
+
+        virtual void draw_transformed_mesh(MeshBase &mesh, Material &material, TransformedVertices &vertices) {}
+
+        virtual void draw_transformed_depth_only(MeshBase &mesh, TransformedVertices &vertices) {}
+
+        virtual void skin_mesh(SkinnedMesh &mesh, const std::vector<glm::mat4> &bones) {}
     };
 
     class SingleThreadRenderer : public Renderer
@@ -479,49 +2666,57 @@ namespace TSRPA
         unsigned int height;
         unsigned int data_size;
 
-        DeephMode deeph_mode;
-        std::function<bool(unsigned int, float)> deep_check_func;
+        DeephMode deeph_mode = DeephMode::NONE;
         std::vector<float> zbuffer;
         bool zbuffer_write = true;
+        BlendMode blend_mode = BLEND_ALPHA;
 
-    public:
-        bool deep_check_none(unsigned int idx, float value) { return true; }
-        bool deep_check_less(unsigned int idx, float value)
-        {
+        bool tile_binning = false;
+        unsigned int tile_size = 32;
+        std::vector<RasterTriangle> binned_triangles;
+        std::vector<std::vector<unsigned int>> tile_bins;
 
-            if (zbuffer[idx] < value)
-            {
-                if (zbuffer_write)
-                {
-                    zbuffer[idx] = value;
-                }
+        RasterTriangle clipped_triangles[MAX_CLIPPED_VERTICES - 2];
 
-                return true;
-            }
-            return false;
-        }
-        bool deep_check_greater(unsigned int idx, float value)
-        {
-            if (zbuffer[idx] > value)
-            {
-                if (zbuffer_write)
-                {
-                    zbuffer[idx] = value;
-                }
-                return true;
-            }
-            return false;
-        }
-        bool calculate_deep_check(unsigned int idx, float value)
-        {
-            return deep_check_func(idx, value);
-        }
+        // reused by every fragment so shading does not construct a ShaderFunctionData per pixel
+        ShaderFunctionData fragment_data;
+        // fragments gathered for the next fragment_shader_packet call and how many lanes of it are used
+        FragmentPacket fragment_packet;
+        int packet_lanes = 0;
+
+        // vertex stage output of the mesh draw_shaded_mesh is drawing
+        TransformedVertices transformed_vertices;
+
+        bool visibility_buffer = false;
+        std::vector<unsigned int> visibility_ids;
+        std::vector<RasterTriangle> visibility_triangles;
+        std::vector<Material *> visibility_materials;
+        // blend mode of the pipeline state each deferred triangle was drawn with, resolve writes its pixels with it
+        std::vector<BlendMode> visibility_blend_modes;
+
+        // screen space error in pixels draw_shaded_mesh and draw_depth_only accept when picking a level of detail, 0 always draws the full mesh
+        float lod_threshold = LOD_THRESHOLD_PIXELS;
+
+        // clusters of the mesh being drawn that survived culling
+        std::vector<MeshCluster> visible_clusters;
+        // clusters it hides are skipped by draw_shaded_mesh and draw_depth_only, NULL tests none
+        OcclusionDetector *occlusion_detector = NULL;
+
+    public:
         void clear_zbuffer()
         {
             for (unsigned int i = 0; i < zbuffer.size(); i++)
             {
                 zbuffer[i] = 0;
             }
+            SingleThreadRenderer::clear_visibility_buffer();
+        }
+        void clear_visibility_buffer()
+        {
+            std::fill(visibility_ids.begin(), visibility_ids.end(), NO_TRIANGLE);
+            visibility_triangles.clear();
+            visibility_materials.clear();
+            visibility_blend_modes.clear();
         }
 
         glm::vec3 calculate_screen_position(const glm::vec3 &vertex, const glm::mat4 &model_transform_matrix)
@@ -562,72 +2757,97 @@ namespace TSRPA
             return screenSpacePos;
         }
 
-        glm::vec3 barycentric(const glm::vec3 *pts, const glm::vec3 &P)
+        // face_mode test on the clip space positions of a face, the sign of det(x, y, w) is the winding of the projected triangle
+        // it holds for vertices behind the camera too, so the test can run before clipping
+        bool is_face_culled(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c)
         {
-            glm::vec3 u = glm::cross(glm::vec3(pts[2][0] - pts[0][0], pts[1][0] - pts[0][0], pts[0][0] - P[0]), glm::vec3(pts[2][1] - pts[0][1], pts[1][1] - pts[0][1], pts[0][1] - P[1]));
-            if (std::abs(u.z) < 1)
+            if (face_mode == ShowFaces::BOTH)
             {
-                return glm::vec3(-1, 1, 1);
+                return false;
             }
-            return glm::vec3(1.f - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z);
+            float det = glm::dot(glm::vec3(a.x, a.y, a.w), glm::cross(glm::vec3(b.x, b.y, b.w), glm::vec3(c.x, c.y, c.w)));
+            return face_mode == ShowFaces::FRONT ? det < 0.0f : det > 0.0f;
         }
 
-        void draw_shaded_triangle(MeshBase &mesh, const unsigned int face_id, Material &material, const glm::mat4 &transform, const glm::mat3 &normal_matrix)
+        // culls and clips one face whose vertices went through the vertex stage
+        // writes up to MAX_CLIPPED_VERTICES - 2 triangles and returns how many are ready to rasterize
+        unsigned int setup_shaded_face(const ShaderFunctionData *vertex_data, const unsigned int varyings, RasterTriangle *triangles)
         {
+            if (SingleThreadRenderer::is_face_culled(vertex_data[0].position, vertex_data[1].position, vertex_data[2].position))
+            {
+                return 0;
+            }
 
-            ShaderFunctionData vertex_data[3];
+            ShaderFunctionData polygon[MAX_CLIPPED_VERTICES];
+            unsigned int count = clip_triangle(vertex_data, guard_band_scale(width, height), polygon);
+            unsigned int triangle_count = 0;
+            for (unsigned int i = 1; i + 1 < count; i++)
+            {
+                if (SingleThreadRenderer::setup_raster_triangle(polygon[0], polygon[i], polygon[i + 1], varyings, triangles[triangle_count]))
+                {
+                    triangle_count++;
+                }
+            }
+            return triangle_count;
+        }
 
+        // runs the vertex stage of one face on its own, with the same uniforms and vertex_shader call as shade_vertices, then sets it up like setup_shaded_face
+        unsigned int setup_shaded_triangle(MeshBase &mesh, const unsigned int face_id, Material &material, const ShaderUniforms &uniforms, RasterTriangle *triangles)
+        {
+            ShaderFunctionData vertex_data[3];
             for (int i = 0; i < 3; i++)
             {
-
-                mesh.get_vertex_data(vertex_data[i], (face_id * 3) + i);
+                mesh.get_vertex_data(vertex_data[i], mesh.get_face_vertex(face_id, i));
+                SingleThreadRenderer::call_vertex_shader(material, vertex_data[i], uniforms, 0);
             }
+            return SingleThreadRenderer::setup_shaded_face(vertex_data, material.get_varyings(), triangles);
+        }
 
-            if (face_mode == ShowFaces::FRONT)
+        // sets up one face from vertices transform_mesh already shaded, faces culled on their positions never read the other streams
+        unsigned int setup_transformed_face(MeshBase &mesh, const TransformedVertices &vertices, const unsigned int face_id, const unsigned int varyings, RasterTriangle *triangles)
+        {
+            unsigned int ids[3];
+            for (int i = 0; i < 3; i++)
             {
-
-                glm::vec3 points[3];
-                points[0] = transform * vertex_data[0].position;
-                points[1] = transform * vertex_data[1].position;
-                points[2] = transform * vertex_data[2].position;
-
-                glm::vec3 cameraPosition = glm::inverse(view_matrix)[3];
-                glm::vec3 edge1 = points[1] - points[0];
-                glm::vec3 edge2 = points[2] - points[0];
-                glm::vec3 normal = glm::cross(edge1, edge2);
-                glm::vec3 viewDir = cameraPosition - points[0];
-                if (glm::dot(normal, viewDir) < 0.0f)
-                {
-                    return;
-                }
+                ids[i] = mesh.get_face_vertex(face_id, i);
             }
-            else if (face_mode == ShowFaces::BACK)
+            if (SingleThreadRenderer::is_face_culled(vertices.get_position(ids[0]), vertices.get_position(ids[1]), vertices.get_position(ids[2])))
             {
-                glm::vec3 points[3];
-                points[0] = transform * vertex_data[0].position;
-                points[1] = transform * vertex_data[1].position;
-                points[2] = transform * vertex_data[2].position;
+                return 0;
+            }
+            ShaderFunctionData vertex_data[3];
+            for (int i = 0; i < 3; i++)
+            {
+                vertices.get(ids[i], vertex_data[i]);
+            }
+            return SingleThreadRenderer::setup_shaded_face(vertex_data, varyings, triangles);
+        }
 
-                glm::vec3 cameraPosition = glm::inverse(view_matrix)[3];
-                glm::vec3 edge1 = points[1] - points[0];
-                glm::vec3 edge2 = points[2] - points[0];
-                glm::vec3 normal = glm::cross(edge1, edge2);
-                glm::vec3 viewDir = cameraPosition - points[0];
-                if (glm::dot(normal, viewDir) > 0.0f)
-                {
-                    return;
-                }
+        // projects the clip space vertices of the triangle to the screen and sets up its bounding box, edges and varying planes
+        bool setup_raster_triangle(const ShaderFunctionData &a, const ShaderFunctionData &b, const ShaderFunctionData &c, const unsigned int varyings, RasterTriangle &triangle)
+        {
+            if (!SingleThreadRenderer::setup_raster_edges(a.position, b.position, c.position, triangle))
+            {
+                return false;
             }
+            triangle.varyings.setup(a, b, c, varyings);
+            return true;
+        }
 
-            glm::ivec2 bboxmin(width - 1, height - 1);
-            glm::ivec2 bboxmax(0, 0);
+        // bounding box and edges only, all a depth test needs
+        bool setup_raster_edges(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c, RasterTriangle &triangle)
+        {
+            const glm::vec4 *positions[3] = {&a, &b, &c};
+            glm::ivec2 &bboxmin = triangle.bboxmin;
+            glm::ivec2 &bboxmax = triangle.bboxmax;
             glm::ivec2 clamp(width - 1, height - 1);
-            glm::vec3 points[3];
+            glm::vec3 *points = triangle.points;
+            bboxmin = clamp;
+            bboxmax = glm::ivec2(0, 0);
 
             for (int i = 0; i < 3; i++)
             {
-                material.vertex_shader(vertex_data[i], projection_matrix, view_matrix, transform, normal_matrix);
-                points[i] = calculate_screen_position_from_point(vertex_data[i].position);
+                points[i] = calculate_screen_position_from_point(*positions[i]);
 
                 bboxmin.x = std::max(0, (int)std::min(bboxmin.x, (int)points[i].x));
                 bboxmin.y = std::max(0, (int)std::min(bboxmin.y, (int)points[i].y));
@@ -635,54 +2855,428 @@ namespace TSRPA
                 bboxmax.x = std::min(clamp.x, std::max(bboxmax.x, (int)points[i].x));
                 bboxmax.y = std::min(clamp.y, std::max(bboxmax.y, (int)points[i].y));
             }
-            glm::vec3 P;
-            for (P.x = bboxmin.x; P.x <= bboxmax.x; P.x++)
+            return bboxmin.x <= bboxmax.x && bboxmin.y <= bboxmax.y && triangle.edges.setup(points);
+        }
+
+        // MaterialT is the static type of the material, when it is final its fragment_shader is inlined here instead of called through the vtable
+        template <BlendMode Blend, typename MaterialT>
+        void shade_fragment(const RasterTriangle &triangle, MaterialT &material, const unsigned int x, const unsigned int y, const glm::vec3 &bc_screen)
+        {
+            triangle.varyings.interpolate(bc_screen.y, bc_screen.z, fragment_data);
+            if (triangle.varyings.mask & VARYING_NORMAL)
+            {
+                fragment_data.normal = glm::normalize(fragment_data.normal);
+            }
+            if (triangle.varyings.mask & VARYING_UV_DERIVATIVES)
+            {
+                SingleThreadRenderer::uv_derivatives(triangle, x, y, bc_screen, fragment_data.uv, fragment_data.uv_ddx, fragment_data.uv_ddy);
+            }
+            SingleThreadRenderer::write_fragment<Blend>(x, y, material.fragment_shader(fragment_data));
+        }
+
+        // ddx and ddy of uv between the fragment and its neighbours in the 2x2 quad it belongs to, as a quad of fragments would difference them
+        // the neighbours come from the triangle planes, so like helper pixels they count even outside the triangle
+        void uv_derivatives(const RasterTriangle &triangle, const unsigned int x, const unsigned int y, const glm::vec3 &bc_screen, const glm::vec2 &uv, glm::vec2 &ddx, glm::vec2 &ddy)
+        {
+            const TriangleEdges &edges = triangle.edges;
+            float dir_x = (x & 1) ? -1.0f : 1.0f;
+            float dir_y = (y & 1) ? -1.0f : 1.0f;
+            float step_x = dir_x * edges.inv_area;
+            float step_y = dir_y * edges.inv_area;
+            ddx = (triangle.varyings.uv_at(bc_screen.y + edges.step_x[1] * step_x, bc_screen.z + edges.step_x[2] * step_x) - uv) * dir_x;
+            ddy = (triangle.varyings.uv_at(bc_screen.y + edges.step_y[1] * step_y, bc_screen.z + edges.step_y[2] * step_y) - uv) * dir_y;
+        }
+
+        template <BlendMode Blend>
+        void write_fragment(const unsigned int x, const unsigned int y, const glm::vec4 &fragment_color)
+        {
+            if (Blend == BLEND_ALPHA && fragment_color.a < 1.0)
+            {
+                glm::vec4 fragment_color_no_alpha = fragment_color;
+                fragment_color_no_alpha.a = 1.0;
+                glm::vec4 framebuffer_color = ((glm::vec4)SingleThreadRenderer::frame_buffer_get_color(x, y)) / glm::vec4(255.0, 255.0, 255.0, 255.0);
+                SingleThreadRenderer::draw_point(x, y, glm::mix(framebuffer_color, fragment_color_no_alpha, fragment_color.a) * glm::vec4(255, 255, 255, 255));
+            }
+            else
+            {
+                SingleThreadRenderer::draw_point(x, y, fragment_color * glm::vec4(255, 255, 255, 255));
+            }
+        }
+
+        // fragment operation of the immediate path, shades every fragment that passes the depth test
+        template <BlendMode Blend, typename MaterialT>
+        struct ShadeFragmentOp
+        {
+            SingleThreadRenderer *renderer;
+            const RasterTriangle *triangle;
+            MaterialT *material;
+            void operator()(const unsigned int x, const unsigned int y, const unsigned int idx, const glm::vec3 &bc_screen) { renderer->shade_fragment<Blend>(*triangle, *material, x, y, bc_screen); }
+        };
+
+        // adds a fragment to fragment_packet and shades the packet once all its lanes are used
+        template <BlendMode Blend, typename MaterialT>
+        void add_packet_fragment(const RasterTriangle &triangle, MaterialT &material, const unsigned int x, const unsigned int y, const glm::vec3 &bc_screen)
+        {
+            int lane = packet_lanes++;
+            fragment_packet.x[lane] = x;
+            fragment_packet.y[lane] = y;
+            triangle.varyings.interpolate(bc_screen.y, bc_screen.z, fragment_packet, lane);
+            if (triangle.varyings.mask & VARYING_UV_DERIVATIVES)
+            {
+                glm::vec2 ddx, ddy;
+                SingleThreadRenderer::uv_derivatives(triangle, x, y, bc_screen, glm::vec2(fragment_packet.uv[0][lane], fragment_packet.uv[1][lane]), ddx, ddy);
+                for (int i = 0; i < 2; i++)
+                {
+                    fragment_packet.uv_ddx[i][lane] = ddx[i];
+                    fragment_packet.uv_ddy[i][lane] = ddy[i];
+                }
+            }
+            fragment_packet.mask |= 1u << lane;
+            if (packet_lanes == FRAGMENT_PACKET_SIZE)
+            {
+                SingleThreadRenderer::shade_packet<Blend>(material);
+            }
+        }
+
+        // shades the fragments gathered in fragment_packet, a triangle flushes its last partial packet before the next one starts
+        template <BlendMode Blend, typename MaterialT>
+        void shade_packet(MaterialT &material)
+        {
+            if (fragment_packet.mask == 0)
+            {
+                return;
+            }
+            material.fragment_shader_packet(fragment_packet);
+            const float(*color)[FRAGMENT_PACKET_SIZE] = fragment_packet.fragment_color;
+            for (int i = 0; i < packet_lanes; i++)
+            {
+                SingleThreadRenderer::write_fragment<Blend>(fragment_packet.x[i], fragment_packet.y[i], glm::vec4(color[0][i], color[1][i], color[2][i], color[3][i]));
+            }
+            fragment_packet.mask = 0;
+            packet_lanes = 0;
+        }
+
+        // fragment operation of the immediate path for materials with a packet shader
+        template <BlendMode Blend, typename MaterialT>
+        struct PacketFragmentOp
+        {
+            SingleThreadRenderer *renderer;
+            const RasterTriangle *triangle;
+            MaterialT *material;
+            void operator()(const unsigned int x, const unsigned int y, const unsigned int idx, const glm::vec3 &bc_screen) { renderer->add_packet_fragment<Blend>(*triangle, *material, x, y, bc_screen); }
+        };
+
+        // fragment operation of the depth only pass, the depth test already did all the work
+        struct DepthFragmentOp
+        {
+            void operator()(const unsigned int x, const unsigned int y, const unsigned int idx, const glm::vec3 &bc_screen) {}
+        };
+
+        // fragment operation of the visibility buffer pass, only remembers which triangle won the pixel
+        struct VisibilityFragmentOp
+        {
+            unsigned int *ids;
+            unsigned int triangle_id;
+            void operator()(const unsigned int x, const unsigned int y, const unsigned int idx, const glm::vec3 &bc_screen) { ids[idx] = triangle_id; }
+        };
+
+        template <DeephMode Mode, bool Write, typename FragmentOp>
+        void rasterize_span(const RasterTriangle &triangle, FragmentOp &op, int x, const int x_end, const int y, const bool covered, const bool simd)
+        {
+            const glm::vec3 *points = triangle.points;
+            const TriangleEdges &edges = triangle.edges;
+
+            unsigned int idx = (unsigned int)y * width + x;
+#ifdef TSRPA_SSE2
+            if (simd)
+            {
+                __m128i e[3], step[3];
+                raster_span_4_setup(edges, x, y, e, step);
+                for (; x + 3 <= x_end; x += 4, idx += 4)
+                {
+                    float bc[12];
+                    int mask = raster_span_4<Mode, Write>(e, edges, points, &zbuffer[idx], bc, covered);
+                    for (int i = 0; mask != 0; i++, mask >>= 1)
+                    {
+                        if (mask & 1)
+                        {
+                            op(x + i, y, idx + i, glm::vec3(bc[i], bc[i + 4], bc[i + 8]));
+                        }
+                    }
+                    for (int i = 0; i < 3; i++)
+                    {
+                        e[i] = _mm_add_epi32(e[i], step[i]);
+                    }
+                }
+            }
+#endif
+            long long e[3] = {edges.at(0, x, y), edges.at(1, x, y), edges.at(2, x, y)};
+            for (; x <= x_end; x++, idx++, e[0] += edges.step_x[0], e[1] += edges.step_x[1], e[2] += edges.step_x[2])
             {
-                for (P.y = bboxmin.y; P.y <= bboxmax.y; P.y++)
+                if (!covered && !edges.covers(e))
+                {
+                    continue;
+                }
+
+                glm::vec3 bc_screen = edges.barycentric(e);
+                float z = 0;
+                for (int i = 0; i < 3; i++)
                 {
-                    glm::vec3 bc_screen = barycentric(points, P);
-                    if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0)
+                    z += points[i][2] * bc_screen[i];
+                }
+                if (depth_test<Mode>(zbuffer[idx], z))
+                {
+                    if (Write && Mode != DeephMode::NONE)
                     {
-                        continue;
+                        zbuffer[idx] = z;
                     }
+                    op(x, y, idx, bc_screen);
+                }
+            }
+        }
 
-                    P.z = 0;
-                    for (int i = 0; i < 3; i++)
+        // walks the bounding box in 8x8 blocks, blocks fully outside the triangle are skipped and blocks fully inside skip the coverage test
+        template <DeephMode Mode, bool Write, typename FragmentOp>
+        void rasterize_triangle(const RasterTriangle &triangle, FragmentOp &op, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
+        {
+            const int block_size = 8;
+            glm::ivec2 bboxmin = glm::max(triangle.bboxmin, rect_min);
+            glm::ivec2 bboxmax = glm::min(triangle.bboxmax, rect_max);
+            bool simd = triangle.edges.fits_int32(bboxmin, bboxmax);
+
+            for (int block_y = bboxmin.y & ~(block_size - 1); block_y <= bboxmax.y; block_y += block_size)
+            {
+                int y0 = std::max(block_y, bboxmin.y);
+                int y1 = std::min(block_y + block_size - 1, bboxmax.y);
+                for (int block_x = bboxmin.x & ~(block_size - 1); block_x <= bboxmax.x; block_x += block_size)
+                {
+                    int x0 = std::max(block_x, bboxmin.x);
+                    int x1 = std::min(block_x + block_size - 1, bboxmax.x);
+                    int coverage = triangle.edges.classify_block(x0, y0, x1, y1);
+                    if (coverage < 0)
                     {
-                        P.z += points[i][2] * bc_screen[i];
+                        continue;
                     }
-                    if (SingleThreadRenderer::calculate_deep_check(int(P.x + P.y * width), P.z))
+                    for (int y = y0; y <= y1; y++)
                     {
+                        SingleThreadRenderer::rasterize_span<Mode, Write>(triangle, op, x0, x1, y, coverage > 0, simd);
+                    }
+                }
+            }
+        }
 
-                        ShaderFunctionData fragment_data;
-                        for (int i = 0; i < 3; i++)
-                        {
-                            fragment_data.position += vertex_data[i].position * bc_screen[i];
-                            fragment_data.uv += vertex_data[i].uv * bc_screen[i];
-                            fragment_data.uv2 += vertex_data[i].uv2 * bc_screen[i];
-                            fragment_data.normal += vertex_data[i].normal * bc_screen[i];
-                            fragment_data.color += vertex_data[i].color * bc_screen[i];
-                        }
-                        fragment_data.normal = glm::normalize(fragment_data.normal);
-                        glm::vec4 fragment_color = material.fragment_shader(fragment_data);
+        template <DeephMode Mode, bool Write, BlendMode Blend, typename MaterialT>
+        void rasterize_shaded_state(const RasterTriangle &triangle, MaterialT &material, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
+        {
+            if (material.has_fragment_shader_packet())
+            {
+                PacketFragmentOp<Blend, MaterialT> op = {this, &triangle, &material};
+                SingleThreadRenderer::rasterize_triangle<Mode, Write>(triangle, op, rect_min, rect_max);
+                SingleThreadRenderer::shade_packet<Blend>(material);
+                return;
+            }
+            ShadeFragmentOp<Blend, MaterialT> op = {this, &triangle, &material};
+            SingleThreadRenderer::rasterize_triangle<Mode, Write>(triangle, op, rect_min, rect_max);
+        }
 
-                        if (fragment_color.a < 1.0)
-                        {
-                            glm::vec4 fragment_color_no_alpha = fragment_color;
-                            fragment_color_no_alpha.a = 1.0;
-                            glm::vec4 framebuffer_color = ((glm::vec4)SingleThreadRenderer::frame_buffer_get_color(P.x, P.y)) / glm::vec4(255.0, 255.0, 255.0, 255.0);
-                            SingleThreadRenderer::draw_point(P.x, P.y, glm::mix(framebuffer_color, fragment_color_no_alpha, fragment_color.a) * glm::vec4(255, 255, 255, 255));
-                        }
-                        else if (fragment_color.a == 0)
-                        {
-                            continue;
-                        }
-                        else
-                        {
-                            SingleThreadRenderer::draw_point(P.x, P.y, fragment_color * glm::vec4(255, 255, 255, 255));
-                        }
+        template <DeephMode Mode, bool Write>
+        void rasterize_visibility_state(const RasterTriangle &triangle, const unsigned int triangle_id, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
+        {
+            VisibilityFragmentOp op = {&visibility_ids[0], triangle_id};
+            SingleThreadRenderer::rasterize_triangle<Mode, Write>(triangle, op, rect_min, rect_max);
+        }
+
+        template <DeephMode Mode, bool Write>
+        void rasterize_depth_state(const RasterTriangle &triangle, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
+        {
+            DepthFragmentOp op;
+            SingleThreadRenderer::rasterize_triangle<Mode, Write>(triangle, op, rect_min, rect_max);
+        }
+
+        template <typename MaterialT>
+        struct ShadedRaster
+        {
+            typedef void (SingleThreadRenderer::*Func)(const RasterTriangle &, MaterialT &, const glm::ivec2 &, const glm::ivec2 &);
+        };
+
+        // raster loops of the current pipeline state, picked by compile_pipeline_state whenever the state changes
+        ShadedRaster<Material>::Func shaded_raster = NULL;
+        void (SingleThreadRenderer::*visibility_raster)(const RasterTriangle &, const unsigned int, const glm::ivec2 &, const glm::ivec2 &) = NULL;
+        void (SingleThreadRenderer::*depth_raster)(const RasterTriangle &, const glm::ivec2 &, const glm::ivec2 &) = NULL;
+
+        template <typename MaterialT, DeephMode Mode, bool Write>
+        typename ShadedRaster<MaterialT>::Func compile_shaded_raster()
+        {
+            if (blend_mode == BLEND_NONE)
+            {
+                return &SingleThreadRenderer::rasterize_shaded_state<Mode, Write, BLEND_NONE, MaterialT>;
+            }
+            return &SingleThreadRenderer::rasterize_shaded_state<Mode, Write, BLEND_ALPHA, MaterialT>;
+        }
+
+        template <typename MaterialT, DeephMode Mode>
+        typename ShadedRaster<MaterialT>::Func compile_shaded_raster()
+        {
+            if (zbuffer_write && Mode != DeephMode::NONE)
+            {
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, Mode, true>();
+            }
+            return SingleThreadRenderer::compile_shaded_raster<MaterialT, Mode, false>();
+        }
+
+        // raster loop of the current pipeline state for materials of static type MaterialT, the templated draw path picks it once per draw
+        template <typename MaterialT>
+        typename ShadedRaster<MaterialT>::Func compile_shaded_raster()
+        {
+            switch (deeph_mode)
+            {
+            case DeephMode::NONE:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::NONE>();
+            case DeephMode::LESS:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::LESS>();
+            case DeephMode::GREATER:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::GREATER>();
+            case DeephMode::LESS_EQUAL:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::LESS_EQUAL>();
+            case DeephMode::GREATER_EQUAL:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::GREATER_EQUAL>();
+            default:
+                return SingleThreadRenderer::compile_shaded_raster<MaterialT, DeephMode::EQUAL>();
+            }
+        }
+
+        template <DeephMode Mode, bool Write>
+        void compile_raster_functions()
+        {
+            shaded_raster = SingleThreadRenderer::compile_shaded_raster<Material, Mode, Write>();
+            visibility_raster = &SingleThreadRenderer::rasterize_visibility_state<Mode, Write>;
+            depth_raster = &SingleThreadRenderer::rasterize_depth_state<Mode, Write>;
+        }
+
+        template <DeephMode Mode>
+        void compile_raster_functions()
+        {
+            if (zbuffer_write && Mode != DeephMode::NONE)
+            {
+                SingleThreadRenderer::compile_raster_functions<Mode, true>();
+            }
+            else
+            {
+                SingleThreadRenderer::compile_raster_functions<Mode, false>();
+            }
+        }
+
+        void compile_pipeline_state()
+        {
+            switch (deeph_mode)
+            {
+            case DeephMode::NONE:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::NONE>();
+                break;
+            case DeephMode::LESS:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::LESS>();
+                break;
+            case DeephMode::GREATER:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::GREATER>();
+                break;
+            case DeephMode::LESS_EQUAL:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::LESS_EQUAL>();
+                break;
+            case DeephMode::GREATER_EQUAL:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::GREATER_EQUAL>();
+                break;
+            default:
+                SingleThreadRenderer::compile_raster_functions<DeephMode::EQUAL>();
+                break;
+            }
+        }
+
+        // with the visibility buffer on the triangle is kept until resolve_visibility_buffer and only its id is written per pixel, otherwise raster shades it
+        template <typename MaterialT>
+        void rasterize_shaded_triangle(const RasterTriangle &triangle, MaterialT &material, typename ShadedRaster<MaterialT>::Func raster, const glm::ivec2 &rect_min, const glm::ivec2 &rect_max)
+        {
+            if (visibility_buffer)
+            {
+                unsigned int triangle_id = visibility_triangles.size();
+                visibility_triangles.push_back(triangle);
+                visibility_materials.push_back(&material);
+                visibility_blend_modes.push_back(blend_mode);
+                (this->*visibility_raster)(triangle, triangle_id, rect_min, rect_max);
+                return;
+            }
+            (this->*raster)(triangle, material, rect_min, rect_max);
+        }
+
+        // one face of mesh, shaded as draw_shaded_mesh would shade it, normal_matrix replaces the one derived from transform
+        void draw_shaded_triangle(MeshBase &mesh, const unsigned int face_id, Material &material, const glm::mat4 &transform, const glm::mat3 &normal_matrix)
+        {
+            ShaderUniforms uniforms(transform, view_matrix, projection_matrix);
+            uniforms.normal_matrix = normal_matrix;
+            unsigned int count = SingleThreadRenderer::setup_shaded_triangle(mesh, face_id, material, uniforms, clipped_triangles);
+            for (unsigned int i = 0; i < count; i++)
+            {
+                SingleThreadRenderer::rasterize_shaded_triangle(clipped_triangles[i], material, shaded_raster, glm::ivec2(0, 0), glm::ivec2(width - 1, height - 1));
+            }
+        }
+
+        // culls, clips and rasterizes one face into the zbuffer only
+        void rasterize_depth_face(const glm::vec4 *positions)
+        {
+            if (SingleThreadRenderer::is_face_culled(positions[0], positions[1], positions[2]))
+            {
+                return;
+            }
+            glm::vec4 polygon[MAX_CLIPPED_VERTICES];
+            unsigned int count = clip_triangle(positions, guard_band_scale(width, height), polygon);
+            for (unsigned int i = 1; i + 1 < count; i++)
+            {
+                if (SingleThreadRenderer::setup_raster_edges(polygon[0], polygon[i], polygon[i + 1], clipped_triangles[0]))
+                {
+                    (this->*depth_raster)(clipped_triangles[0], glm::ivec2(0, 0), glm::ivec2(width - 1, height - 1));
+                }
+            }
+        }
+
+        // fills only the zbuffer, skipping the material, varyings and frame buffer
+        // positions are transformed like the default Material::vertex_shader does, so a later pass with EQUAL or LESS_EQUAL matches the depth exactly
+        void draw_depth_only(MeshBase &full_mesh, const glm::mat4 &transform)
+        {
+            glm::mat4 mvp = projection_matrix * view_matrix * transform;
+            if (bounds_outside_frustum(full_mesh.get_bounds(), mvp))
+            {
+                return;
+            }
+            MeshBase &mesh = SingleThreadRenderer::select_lod(full_mesh, transform, mvp);
+            SingleThreadRenderer::cull_clusters(mesh, transform, mvp);
+            VertexLayout layout;
+            bool direct = mesh.get_vertex_layout(layout);
+            for (unsigned int c = 0; c < visible_clusters.size(); c++)
+            {
+                const MeshCluster &cluster = visible_clusters[c];
+                for (unsigned int face_id = cluster.first_face; face_id < cluster.first_face + cluster.face_count; face_id++)
+                {
+                    glm::vec4 positions[3];
+                    for (int i = 0; i < 3; i++)
+                    {
+                        unsigned int id = mesh.get_face_vertex(face_id, i);
+                        positions[i] = mvp * (direct ? read_attribute(layout.attributes[ATTRIBUTE_POSITION], id, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)) : mesh.get_vertex_position(id));
                     }
+                    SingleThreadRenderer::rasterize_depth_face(positions);
+                }
+            }
+        }
+
+        // depth only pass over vertices transform_mesh already shaded, so a custom vertex shader matches the colour pass too
+        void draw_transformed_depth_only(MeshBase &mesh, TransformedVertices &vertices)
+        {
+            for (unsigned int face_id = 0; face_id < mesh.face_count; face_id++)
+            {
+                glm::vec4 positions[3];
+                for (int i = 0; i < 3; i++)
+                {
+                    positions[i] = vertices.get_position(mesh.get_face_vertex(face_id, i));
                 }
+                SingleThreadRenderer::rasterize_depth_face(positions);
             }
         }
 
@@ -698,6 +3292,12 @@ namespace TSRPA
         ShowFaces get_face_mode() { return face_mode; }
         void set_face_mode(ShowFaces mode) { face_mode = mode; }
 
+        OcclusionDetector *get_occlusion_detector() { return occlusion_detector; }
+        void set_occlusion_detector(OcclusionDetector *detector) { occlusion_detector = detector; }
+
+        float get_lod_threshold() { return lod_threshold; }
+        void set_lod_threshold(float pixels) { lod_threshold = std::max(0.0f, pixels); }
+
         glm::mat4 get_view_matrix() { return view_matrix; }
         void set_view_matrix(const glm::mat4 &mat) { view_matrix = mat; }
 
@@ -708,24 +3308,126 @@ namespace TSRPA
         unsigned int get_height() { return height; }
 
         bool get_zbuffer_write() { return zbuffer_write; }
-        void set_zbuffer_write(bool on) { zbuffer_write = on; }
+        void set_zbuffer_write(bool on)
+        {
+            zbuffer_write = on;
+            SingleThreadRenderer::compile_pipeline_state();
+        }
+
+        BlendMode get_blend_mode() { return blend_mode; }
+        void set_blend_mode(BlendMode mode)
+        {
+            blend_mode = mode;
+            SingleThreadRenderer::compile_pipeline_state();
+        }
+
+        PipelineState get_pipeline_state() { return PipelineState(deeph_mode, zbuffer_write, face_mode, blend_mode); }
+        void set_pipeline_state(const PipelineState &state)
+        {
+            zbuffer_write = state.depth_write;
+            face_mode = state.cull_mode;
+            blend_mode = state.blend_mode;
+            SingleThreadRenderer::set_deeph_mode(state.depth_mode);
+        }
 
         DeephMode get_deeph_mode() { return deeph_mode; }
         void set_deeph_mode(DeephMode mode)
         {
             deeph_mode = mode;
-            switch (mode)
+            SingleThreadRenderer::compile_pipeline_state();
+        }
+
+        bool get_tile_binning() { return tile_binning; }
+        void set_tile_binning(bool on) { tile_binning = on; }
+
+        unsigned int get_tile_size() { return tile_size; }
+        void set_tile_size(unsigned int size) { tile_size = std::max(1u, size); }
+
+        bool get_visibility_buffer() { return visibility_buffer; }
+        void set_visibility_buffer(bool on)
+        {
+            if (!on)
             {
-            case 0:
-                deep_check_func = std::bind(&SingleThreadRenderer::deep_check_none, this, std::placeholders::_1, std::placeholders::_2);
-                break;
-            case 1:
-                deep_check_func = std::bind(&SingleThreadRenderer::deep_check_less, this, std::placeholders::_1, std::placeholders::_2);
-                break;
-            case 2:
-                deep_check_func = std::bind(&SingleThreadRenderer::deep_check_greater, this, std::placeholders::_1, std::placeholders::_2);
-                break;
+                SingleThreadRenderer::resolve_visibility_buffer();
+            }
+            visibility_buffer = on;
+            visibility_ids.resize(on ? width * height : 0, NO_TRIANGLE);
+        }
+
+        // shades every pixel covered by a deferred triangle exactly once, then forgets the deferred triangles
+        void resolve_visibility_buffer()
+        {
+            if (visibility_triangles.empty())
+            {
+                return;
+            }
+            // neighbouring pixels of one packet material and blend mode share a packet, whatever triangle they belong to
+            Material *current_material = NULL;
+            BlendMode current_blend = BLEND_ALPHA;
+            bool packet = false;
+            for (unsigned int y = 0, idx = 0; y < height; y++)
+            {
+                for (unsigned int x = 0; x < width; x++, idx++)
+                {
+                    unsigned int id = visibility_ids[idx];
+                    if (id == NO_TRIANGLE)
+                    {
+                        continue;
+                    }
+                    const RasterTriangle &triangle = visibility_triangles[id];
+                    Material *material = visibility_materials[id];
+                    BlendMode blend = visibility_blend_modes[id];
+                    long long e[3] = {triangle.edges.at(0, x, y), triangle.edges.at(1, x, y), triangle.edges.at(2, x, y)};
+                    if (material != current_material || blend != current_blend)
+                    {
+                        if (packet)
+                        {
+                            SingleThreadRenderer::resolve_packet(*current_material, current_blend);
+                        }
+                        current_material = material;
+                        current_blend = blend;
+                        packet = material->has_fragment_shader_packet();
+                    }
+                    if (blend == BLEND_NONE)
+                    {
+                        SingleThreadRenderer::resolve_fragment<BLEND_NONE>(triangle, *material, packet, x, y, triangle.edges.barycentric(e));
+                    }
+                    else
+                    {
+                        SingleThreadRenderer::resolve_fragment<BLEND_ALPHA>(triangle, *material, packet, x, y, triangle.edges.barycentric(e));
+                    }
+                    visibility_ids[idx] = NO_TRIANGLE;
+                }
+            }
+            if (packet)
+            {
+                SingleThreadRenderer::resolve_packet(*current_material, current_blend);
+            }
+            visibility_triangles.clear();
+            visibility_materials.clear();
+            visibility_blend_modes.clear();
+        }
+
+        // shades a deferred fragment with the same write the immediate path of its blend mode uses
+        template <BlendMode Blend>
+        void resolve_fragment(const RasterTriangle &triangle, Material &material, const bool packet, const unsigned int x, const unsigned int y, const glm::vec3 &bc_screen)
+        {
+            if (packet)
+            {
+                SingleThreadRenderer::add_packet_fragment<Blend>(triangle, material, x, y, bc_screen);
+                return;
+            }
+            SingleThreadRenderer::shade_fragment<Blend, Material>(triangle, material, x, y, bc_screen);
+        }
+
+        void resolve_packet(Material &material, const BlendMode blend)
+        {
+            if (blend == BLEND_NONE)
+            {
+                SingleThreadRenderer::shade_packet<BLEND_NONE>(material);
+                return;
             }
+            SingleThreadRenderer::shade_packet<BLEND_ALPHA>(material);
         }
 
         SingleThreadRenderer(unsigned int width, unsigned int height) : Renderer()
@@ -736,10 +3438,12 @@ namespace TSRPA
 
             frame_buffer.resize(this->width * this->height * 4);
             zbuffer.resize(this->width * this->height);
+            SingleThreadRenderer::set_deeph_mode(DeephMode::NONE);
         }
 
         unsigned char *get_result()
         {
+            SingleThreadRenderer::resolve_visibility_buffer();
             return &frame_buffer[0];
         }
 
@@ -860,12 +3564,253 @@ namespace TSRPA
             }
         }
 
+        // bins every triangle of the mesh into screen tiles first, then rasterizes one tile at a time so its slice of frame_buffer and zbuffer stays in cache
+        template <typename MaterialT>
+        void draw_shaded_mesh_binned(MeshBase &mesh, MaterialT &material, typename ShadedRaster<MaterialT>::Func raster, const TransformedVertices &vertices, const std::vector<MeshCluster> &clusters)
+        {
+            unsigned int tiles_x = (width + tile_size - 1) / tile_size;
+            unsigned int tiles_y = (height + tile_size - 1) / tile_size;
+            tile_bins.resize(tiles_x * tiles_y);
+            for (unsigned int i = 0; i < tile_bins.size(); i++)
+            {
+                tile_bins[i].clear();
+            }
+            binned_triangles.clear();
+
+            unsigned int varyings = material.get_varyings();
+            for (unsigned int c = 0; c < clusters.size(); c++)
+            {
+                for (unsigned int i = clusters[c].first_face; i < clusters[c].first_face + clusters[c].face_count; i++)
+                {
+                    unsigned int count = SingleThreadRenderer::setup_transformed_face(mesh, vertices, i, varyings, clipped_triangles);
+                    for (unsigned int j = 0; j < count; j++)
+                    {
+                        const RasterTriangle &triangle = clipped_triangles[j];
+                        unsigned int triangle_id = binned_triangles.size();
+                        binned_triangles.push_back(triangle);
+                        for (unsigned int ty = triangle.bboxmin.y / tile_size; ty <= triangle.bboxmax.y / tile_size; ty++)
+                        {
+                            for (unsigned int tx = triangle.bboxmin.x / tile_size; tx <= triangle.bboxmax.x / tile_size; tx++)
+                            {
+                                tile_bins[ty * tiles_x + tx].push_back(triangle_id);
+                            }
+                        }
+                    }
+                }
+            }
+
+            unsigned int first_visibility_id = visibility_triangles.size();
+            if (visibility_buffer)
+            {
+                visibility_triangles.insert(visibility_triangles.end(), binned_triangles.begin(), binned_triangles.end());
+                visibility_materials.resize(visibility_triangles.size(), &material);
+                visibility_blend_modes.resize(visibility_triangles.size(), blend_mode);
+            }
+
+            for (unsigned int ty = 0; ty < tiles_y; ty++)
+            {
+                for (unsigned int tx = 0; tx < tiles_x; tx++)
+                {
+                    const std::vector<unsigned int> &bin = tile_bins[ty * tiles_x + tx];
+                    glm::ivec2 rect_min(tx * tile_size, ty * tile_size);
+                    glm::ivec2 rect_max(std::min(width, (tx + 1) * tile_size) - 1, std::min(height, (ty + 1) * tile_size) - 1);
+                    for (unsigned int i = 0; i < bin.size(); i++)
+                    {
+                        if (visibility_buffer)
+                        {
+                            (this->*visibility_raster)(binned_triangles[bin[i]], first_visibility_id + bin[i], rect_min, rect_max);
+                        }
+                        else
+                        {
+                            (this->*raster)(binned_triangles[bin[i]], material, rect_min, rect_max);
+                        }
+                    }
+                }
+            }
+        }
+
+        // poses mesh with the bone palette of this frame, draws issued after it see the skinned vertices
+        void skin_mesh(SkinnedMesh &mesh, const std::vector<glm::mat4> &bones)
+        {
+            mesh.skin(bones);
+        }
+
+        // vertex stage of the whole mesh, every vertex is fetched and shaded once into vertices
+        void transform_mesh(MeshBase &mesh, Material &material, const glm::mat4 &transform, TransformedVertices &vertices)
+        {
+            ShaderUniforms uniforms(transform, view_matrix, projection_matrix);
+            SingleThreadRenderer::shade_vertices(mesh, material, uniforms, vertices);
+        }
+
+        // calls the vertex_shader(data, uniforms) of MaterialT directly when MaterialT exposes it
+        template <typename MaterialT>
+        static auto call_vertex_shader(MaterialT &material, ShaderFunctionData &data, const ShaderUniforms &uniforms, int) -> decltype(material.vertex_shader(data, uniforms), void())
+        {
+            material.vertex_shader(data, uniforms);
+        }
+        // a LegacyMaterial that only overrides the per-matrix vertex_shader hides the uniforms one, it is reached through Material which dispatches to LegacyMaterial
+        static void call_vertex_shader(Material &material, ShaderFunctionData &data, const ShaderUniforms &uniforms, long)
+        {
+            material.vertex_shader(data, uniforms);
+        }
+
+        template <typename MaterialT>
+        void shade_vertices(MeshBase &mesh, MaterialT &material, const ShaderUniforms &uniforms, TransformedVertices &vertices)
+        {
+            VertexLayout layout;
+            bool direct = mesh.get_vertex_layout(layout);
+            if (direct)
+            {
+                vertices.fetch(layout, mesh.vert_count);
+            }
+            else
+            {
+                vertices.resize(mesh.vert_count);
+            }
+            for (unsigned int i = 0; i < mesh.vert_count; i++)
+            {
+                ShaderFunctionData data;
+                if (direct)
+                {
+                    vertices.get(i, data);
+                }
+                else
+                {
+                    mesh.get_vertex_data(data, i);
+                }
+                SingleThreadRenderer::call_vertex_shader(material, data, uniforms, 0);
+                vertices.set(i, data);
+            }
+        }
+
+        // triangle setup and raster of the faces in clusters, over vertices transform_mesh already shaded
+        template <typename MaterialT>
+        void draw_transformed_clusters(MeshBase &mesh, MaterialT &material, const TransformedVertices &vertices, const std::vector<MeshCluster> &clusters)
+        {
+            typename ShadedRaster<MaterialT>::Func raster = SingleThreadRenderer::compile_shaded_raster<MaterialT>();
+            if (tile_binning)
+            {
+                SingleThreadRenderer::draw_shaded_mesh_binned(mesh, material, raster, vertices, clusters);
+                return;
+            }
+            unsigned int varyings = material.get_varyings();
+            for (unsigned int c = 0; c < clusters.size(); c++)
+            {
+                for (unsigned int i = clusters[c].first_face; i < clusters[c].first_face + clusters[c].face_count; i++)
+                {
+                    unsigned int count = SingleThreadRenderer::setup_transformed_face(mesh, vertices, i, varyings, clipped_triangles);
+                    for (unsigned int j = 0; j < count; j++)
+                    {
+                        SingleThreadRenderer::rasterize_shaded_triangle(clipped_triangles[j], material, raster, glm::ivec2(0, 0), glm::ivec2(width - 1, height - 1));
+                    }
+                }
+            }
+        }
+
+        // triangle setup and raster of a mesh transform_mesh already shaded, the same vertices can be drawn by several passes
+        void draw_transformed_mesh(MeshBase &mesh, Material &material, TransformedVertices &vertices)
+        {
+            visible_clusters.assign(1, mesh.whole_cluster());
+            SingleThreadRenderer::draw_transformed_clusters(mesh, material, vertices, visible_clusters);
+        }
+
+        // fills visible_clusters with the clusters of mesh that are inside the frustum, not all culled by face_mode and not hidden from occlusion_detector
+        // a mesh without clusters is kept as one
+        void cull_clusters(MeshBase &mesh, const glm::mat4 &transform, const glm::mat4 &mvp)
+        {
+            visible_clusters.clear();
+            const std::vector<MeshCluster> &clusters = mesh.get_clusters();
+            if (clusters.empty())
+            {
+                visible_clusters.push_back(mesh.whole_cluster());
+                return;
+            }
+            glm::vec4 eye = camera_object_position(mvp);
+            // FRONT culls a negative det(x, y, w), BACK a positive one
+            float facing = clip_winding_sign(mvp, eye) * (face_mode == ShowFaces::FRONT ? 1.0f : -1.0f);
+            for (unsigned int i = 0; i < clusters.size(); i++)
+            {
+                const MeshCluster &cluster = clusters[i];
+                if (face_mode != ShowFaces::BOTH && cluster_faces_away(cluster, eye, facing))
+                {
+                    continue;
+                }
+                if (sphere_outside_frustum(cluster.center, cluster.radius, mvp))
+                {
+                    continue;
+                }
+                if (occlusion_detector && !occlusion_detector->check_sphere(cluster.center, cluster.radius, transform))
+                {
+                    continue;
+                }
+                visible_clusters.push_back(cluster);
+            }
+        }
+
+        // the same level draw_shaded_mesh and draw_depth_only pick, so a depth prepass and the colour pass still match exactly
+        MeshBase &select_lod(MeshBase &mesh, const glm::mat4 &transform, const glm::mat4 &mvp)
+        {
+            if (lod_threshold <= 0.0f)
+            {
+                return mesh;
+            }
+            return mesh.select_lod(lod_max_error(mesh.get_bounds(), transform, mvp, projection_matrix, height, lod_threshold));
+        }
+
+        // culling, level of detail, vertex stage and raster of one copy of full_mesh placed by uniforms.model
+        template <typename MaterialT>
+        void draw_mesh_instance(MeshBase &full_mesh, MaterialT &material, const ShaderUniforms &uniforms)
+        {
+            if (bounds_outside_frustum(full_mesh.get_bounds(), uniforms.mvp))
+            {
+                return;
+            }
+            MeshBase &mesh = SingleThreadRenderer::select_lod(full_mesh, uniforms.model, uniforms.mvp);
+            SingleThreadRenderer::cull_clusters(mesh, uniforms.model, uniforms.mvp);
+            if (visible_clusters.empty())
+            {
+                return;
+            }
+            SingleThreadRenderer::shade_vertices(mesh, material, uniforms, transformed_vertices);
+            SingleThreadRenderer::draw_transformed_clusters(mesh, material, transformed_vertices, visible_clusters);
+        }
+
         void draw_shaded_mesh(MeshBase &mesh, Material &material, glm::mat4 &transform)
         {
-            glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(transform)));
-            for (unsigned int i = 0; i < mesh.face_count; i++)
+            ShaderUniforms uniforms(transform, view_matrix, projection_matrix);
+            SingleThreadRenderer::draw_mesh_instance(mesh, material, uniforms);
+        }
+
+        // runs draw now, MultThreadRenderer queues it on its render thread
+        // templates cannot be virtual, so draws such as draw_shaded_mesh_static reach the thread of the renderer through this
+        virtual void queue_draw(const std::function<void()> &draw) { draw(); }
+
+        // the same draw for a material whose type is known at compile time, the raster loop is instantiated for MaterialT
+        // a MaterialT declared final gets its vertex_shader and fragment_shader inlined, draw_shaded_mesh above stays the call for any Material
+        // it goes through queue_draw, so through a SingleThreadRenderer& to a MultThreadRenderer it still runs on the render thread
+        template <typename MaterialT>
+        void draw_shaded_mesh_static(MeshBase &mesh, MaterialT &material, glm::mat4 &transform)
+        {
+            queue_draw(std::bind(&SingleThreadRenderer::ptr_draw_shaded_mesh_static<MaterialT>, this, &mesh, &material, transform));
+        }
+        template <typename MaterialT>
+        void ptr_draw_shaded_mesh_static(MeshBase *mesh, MaterialT *material, const glm::mat4 &transform)
+        {
+            ShaderUniforms uniforms(transform, view_matrix, projection_matrix);
+            SingleThreadRenderer::draw_mesh_instance(*mesh, *material, uniforms);
+        }
+
+        // count copies of mesh, one per transform, sharing the view and projection work of a single draw
+        // instance_data, when not NULL, holds count elements instance_stride bytes apart, the vertex shader finds the one of its instance in uniforms.instance_data
+        void draw_shaded_mesh_instanced(MeshBase &mesh, Material &material, const glm::mat4 *transforms, unsigned int count, const void *instance_data = NULL, unsigned int instance_stride = 0)
+        {
+            ShaderUniforms uniforms(glm::mat4(1.0f), view_matrix, projection_matrix);
+            for (unsigned int i = 0; i < count; i++)
             {
-                SingleThreadRenderer::draw_shaded_triangle(mesh, i, material, transform, normal_matrix);
+                uniforms.set_model(transforms[i]);
+                uniforms.instance_id = i;
+                uniforms.instance_data = instance_data != NULL ? (const unsigned char *)instance_data + i * instance_stride : NULL;
+                SingleThreadRenderer::draw_mesh_instance(mesh, material, uniforms);
             }
         }
     };
@@ -971,6 +3916,8 @@ namespace TSRPA
 
         DeephMode safe_deeph_mode;
 
+        BlendMode safe_blend_mode = BLEND_ALPHA;
+
         glm::ivec4 safe_lear_color;
 
         ShowFaces safe_face_mode;
@@ -978,6 +3925,15 @@ namespace TSRPA
         glm::mat4 safe_view_matrix;
         glm::mat4 safe_projection_matrix;
 
+        bool safe_tile_binning = false;
+        unsigned int safe_tile_size = 32;
+
+        bool safe_visibility_buffer = false;
+
+        float safe_lod_threshold = LOD_THRESHOLD_PIXELS;
+
+        OcclusionDetector *safe_occlusion_detector = NULL;
+
     public:
         bool get_zbuffer_write() override { return safe_zbuffer_write; }
         void base_set_zbuffer_write(bool on)
@@ -1001,6 +3957,96 @@ namespace TSRPA
             task_list.add_task(std::bind(&MultThreadRenderer::base_set_deeph_mode, this, mode));
         }
 
+        BlendMode get_blend_mode() override { return safe_blend_mode; }
+        void base_set_blend_mode(BlendMode mode)
+        {
+            SingleThreadRenderer::set_blend_mode(mode);
+        }
+        void set_blend_mode(BlendMode mode) override
+        {
+            safe_blend_mode = mode;
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_blend_mode, this, mode));
+        }
+
+        PipelineState get_pipeline_state() override { return PipelineState(safe_deeph_mode, safe_zbuffer_write, safe_face_mode, safe_blend_mode); }
+        void base_set_pipeline_state(PipelineState state)
+        {
+            SingleThreadRenderer::set_pipeline_state(state);
+        }
+        void set_pipeline_state(const PipelineState &state) override
+        {
+            safe_deeph_mode = state.depth_mode;
+            safe_zbuffer_write = state.depth_write;
+            safe_face_mode = state.cull_mode;
+            safe_blend_mode = state.blend_mode;
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_pipeline_state, this, state));
+        }
+
+        bool get_tile_binning() override { return safe_tile_binning; }
+        void base_set_tile_binning(bool on)
+        {
+            SingleThreadRenderer::set_tile_binning(on);
+        }
+        void set_tile_binning(bool on) override
+        {
+            safe_tile_binning = on;
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_tile_binning, this, on));
+        }
+
+        unsigned int get_tile_size() override { return safe_tile_size; }
+        void base_set_tile_size(unsigned int size)
+        {
+            SingleThreadRenderer::set_tile_size(size);
+        }
+        void set_tile_size(unsigned int size) override
+        {
+            safe_tile_size = std::max(1u, size);
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_tile_size, this, size));
+        }
+
+        bool get_visibility_buffer() override { return safe_visibility_buffer; }
+        void base_set_visibility_buffer(bool on)
+        {
+            SingleThreadRenderer::set_visibility_buffer(on);
+        }
+        void set_visibility_buffer(bool on) override
+        {
+            safe_visibility_buffer = on;
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_visibility_buffer, this, on));
+        }
+
+        float get_lod_threshold() override { return safe_lod_threshold; }
+        void base_set_lod_threshold(float pixels)
+        {
+            SingleThreadRenderer::set_lod_threshold(pixels);
+        }
+        void set_lod_threshold(float pixels) override
+        {
+            safe_lod_threshold = std::max(0.0f, pixels);
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_lod_threshold, this, pixels));
+        }
+
+        // the detector is read when a queued draw runs, so it must not change until get_result returns
+        OcclusionDetector *get_occlusion_detector() override { return safe_occlusion_detector; }
+        void base_set_occlusion_detector(OcclusionDetector *detector)
+        {
+            SingleThreadRenderer::set_occlusion_detector(detector);
+        }
+        void set_occlusion_detector(OcclusionDetector *detector) override
+        {
+            safe_occlusion_detector = detector;
+            task_list.add_task(std::bind(&MultThreadRenderer::base_set_occlusion_detector, this, detector));
+        }
+
+        void base_resolve_visibility_buffer()
+        {
+            SingleThreadRenderer::resolve_visibility_buffer();
+        }
+        void resolve_visibility_buffer() override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::base_resolve_visibility_buffer, this));
+        }
+
         unsigned int get_width() override { return safe_width_height[0]; }
         unsigned int get_height() override { return safe_width_height[1]; }
 
@@ -1131,6 +4177,73 @@ namespace TSRPA
             task_list.add_task(std::bind(&MultThreadRenderer::ptr_draw_shaded_mesh, this, &mesh, &material, transform));
         }
 
+        void queue_draw(const std::function<void()> &draw) override
+        {
+            task_list.add_task(draw);
+        }
+
+        void ptr_draw_shaded_mesh_instanced(MeshBase *mesh, Material *material, const std::vector<glm::mat4> &transforms, const std::vector<unsigned char> &instance_data, unsigned int instance_stride)
+        {
+            SingleThreadRenderer::draw_shaded_mesh_instanced(*mesh, *material, transforms.data(), transforms.size(), instance_data.empty() ? NULL : instance_data.data(), instance_stride);
+        }
+        // one task for all instances, the transforms and instance data are copied into it so the caller may reuse its arrays right away
+        void draw_shaded_mesh_instanced(MeshBase &mesh, Material &material, const glm::mat4 *transforms, unsigned int count, const void *instance_data = NULL, unsigned int instance_stride = 0) override
+        {
+            std::vector<glm::mat4> transform_copy(transforms, transforms + count);
+            std::vector<unsigned char> instance_copy;
+            if (instance_data != NULL)
+            {
+                instance_copy.assign((const unsigned char *)instance_data, (const unsigned char *)instance_data + count * instance_stride);
+            }
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_draw_shaded_mesh_instanced, this, &mesh, &material, std::move(transform_copy), std::move(instance_copy), instance_stride));
+        }
+
+        void ptr_draw_depth_only(MeshBase *mesh, const glm::mat4 &transform)
+        {
+            SingleThreadRenderer::draw_depth_only(*mesh, transform);
+        }
+        void draw_depth_only(MeshBase &mesh, const glm::mat4 &transform) override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_draw_depth_only, this, &mesh, transform));
+        }
+
+        void ptr_transform_mesh(MeshBase *mesh, Material *material, const glm::mat4 &transform, TransformedVertices *vertices)
+        {
+            SingleThreadRenderer::transform_mesh(*mesh, *material, transform, *vertices);
+        }
+        void transform_mesh(MeshBase &mesh, Material &material, const glm::mat4 &transform, TransformedVertices &vertices) override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_transform_mesh, this, &mesh, &material, transform, &vertices));
+        }
+
+        void ptr_draw_transformed_mesh(MeshBase *mesh, Material *material, TransformedVertices *vertices)
+        {
+            SingleThreadRenderer::draw_transformed_mesh(*mesh, *material, *vertices);
+        }
+        void draw_transformed_mesh(MeshBase &mesh, Material &material, TransformedVertices &vertices) override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_draw_transformed_mesh, this, &mesh, &material, &vertices));
+        }
+
+        void ptr_draw_transformed_depth_only(MeshBase *mesh, TransformedVertices *vertices)
+        {
+            SingleThreadRenderer::draw_transformed_depth_only(*mesh, *vertices);
+        }
+        void draw_transformed_depth_only(MeshBase &mesh, TransformedVertices &vertices) override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_draw_transformed_depth_only, this, &mesh, &vertices));
+        }
+
+        // the palette is copied into the task, so the caller can reuse its vector for the next character right away
+        void ptr_skin_mesh(SkinnedMesh *mesh, std::vector<glm::mat4> bones)
+        {
+            SingleThreadRenderer::skin_mesh(*mesh, bones);
+        }
+        void skin_mesh(SkinnedMesh &mesh, const std::vector<glm::mat4> &bones) override
+        {
+            task_list.add_task(std::bind(&MultThreadRenderer::ptr_skin_mesh, this, &mesh, bones));
+        }
+
         MultThreadRenderer(unsigned int width, unsigned int height) : SingleThreadRenderer(width, height)
         {
 
@@ -1148,6 +4261,7 @@ namespace TSRPA
 
         unsigned char *get_result() override
         {
+            MultThreadRenderer::resolve_visibility_buffer();
             task_list.wait_for_completion();
             return &frame_buffer[0];
         }